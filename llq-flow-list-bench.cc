@@ -0,0 +1,101 @@
+/*
+ * Microbenchmark of the flow rotation of LLQQueueDisc.
+ *
+ * Thousands of UDP flows are kept active in a LLQQueueDisc whose quantum is
+ * smaller than a packet, so that every dequeue exhausts the deficit of the
+ * served flow and moves it between the new and the old flow lists. Every
+ * dequeued packet is enqueued again, so the number of active flows does not
+ * change, and the average cost of a dequeue (plus the enqueue keeping the
+ * flow active) is reported. Running the program on a tree before and after a
+ * change of the flow lists gives the cost of the two implementations.
+ *
+ * Usage: ./ns3 run "llq-flow-list-bench --flows=10000 --packets=10000000"
+ */
+
+#include "ns3/core-module.h"
+#include "ns3/internet-module.h"
+#include "ns3/llq-queue-disc.h"
+#include "ns3/network-module.h"
+#include "ns3/traffic-control-module.h"
+
+#include <chrono>
+#include <iostream>
+
+using namespace ns3;
+
+/**
+ * Create a UDP packet of a flow.
+ *
+ * \param flow the flow, which gives the source address and port of the packet
+ * \param size the payload size
+ * \return the packet
+ */
+static Ptr<QueueDiscItem>
+CreateItem(uint32_t flow, uint32_t size)
+{
+    Ptr<Packet> p = Create<Packet>(size);
+    UdpHeader udpHeader;
+    udpHeader.SetSourcePort(1024 + (flow & 0xfff));
+    udpHeader.SetDestinationPort(5000);
+    p->AddHeader(udpHeader);
+
+    Ipv4Header ipHeader;
+    ipHeader.SetSource(Ipv4Address(0x0a000000 + (flow >> 12)));
+    ipHeader.SetDestination(Ipv4Address("10.255.0.1"));
+    ipHeader.SetProtocol(UdpL4Protocol::PROT_NUMBER);
+    ipHeader.SetPayloadSize(p->GetSize());
+    ipHeader.SetTtl(64);
+    return Create<Ipv4QueueDiscItem>(p, Address(), Ipv4L3Protocol::PROT_NUMBER, ipHeader);
+}
+
+int
+main(int argc, char* argv[])
+{
+    uint32_t flows = 10000;
+    uint32_t buckets = 65536;
+    uint32_t depth = 2;
+    uint64_t packets = 10000000;
+    uint32_t size = 500;
+
+    CommandLine cmd(__FILE__);
+    cmd.AddValue("flows", "Number of active flows", flows);
+    cmd.AddValue("buckets", "Number of flow queues of the queue disc", buckets);
+    cmd.AddValue("depth", "Number of packets kept in each flow", depth);
+    cmd.AddValue("packets", "Number of packets to dequeue", packets);
+    cmd.AddValue("size", "Payload size of the packets in bytes", size);
+    cmd.Parse(argc, argv);
+
+    Ptr<LLQQueueDisc> qdisc = CreateObject<LLQQueueDisc>();
+    qdisc->SetAttribute("Flows", UintegerValue(buckets));
+    qdisc->SetAttribute("MaxSize",
+                        QueueSizeValue(QueueSize(QueueSizeUnit::PACKETS, flows * depth + 1)));
+    // a quantum smaller than a packet makes every dequeue rotate a flow
+    qdisc->SetQuantum(size / 2);
+    qdisc->Initialize();
+
+    for (uint32_t i = 0; i < depth; i++)
+    {
+        for (uint32_t flow = 0; flow < flows; flow++)
+        {
+            qdisc->Enqueue(CreateItem(flow, size));
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint64_t n = 0; n < packets; n++)
+    {
+        Ptr<QueueDiscItem> item = qdisc->Dequeue();
+        NS_ABORT_MSG_IF(!item, "The queue disc ran out of packets");
+        qdisc->Enqueue(item);
+    }
+
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << qdisc->GetNQueueDiscClasses() << " flow queues, " << packets
+              << " packets dequeued, " << elapsed.count() / packets << " ns per dequeue"
+              << std::endl;
+
+    Simulator::Destroy();
+    return 0;
+}
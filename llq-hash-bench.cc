@@ -0,0 +1,144 @@
+/*
+ * Microbenchmark of the flow hash functions of LLQQueueDisc.
+ *
+ * For each hash function (HashFunction attribute) and for 1k, 64k and 1M
+ * UDP flows, one packet per flow is enqueued into a LLQQueueDisc without set
+ * associative hash, so that the flows are spread over the flow queues by the
+ * hash alone. The number of flow queues in use is compared with the one
+ * expected from a uniform hash, and the largest number of flows sharing a
+ * queue with the mean number of flows per queue. Then the queue disc is
+ * emptied and packets of random flows are enqueued and dequeued one at a
+ * time; the average cost of such a pair is reported, which only differs among
+ * the hash functions by the cost of the hash. The program first prints which
+ * implementation of Crc32c the CPU runs.
+ *
+ * Usage: ./ns3 run "llq-hash-bench --buckets=65536 --packets=10000000"
+ */
+
+#include "ns3/core-module.h"
+#include "ns3/internet-module.h"
+#include "ns3/llq-queue-disc.h"
+#include "ns3/network-module.h"
+#include "ns3/traffic-control-module.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+using namespace ns3;
+
+/**
+ * Create a UDP packet of a flow.
+ *
+ * \param flow the flow, which gives the source address and port of the packet
+ * \param size the payload size
+ * \return the packet
+ */
+static Ptr<QueueDiscItem>
+CreateItem(uint32_t flow, uint32_t size)
+{
+    Ptr<Packet> p = Create<Packet>(size);
+    UdpHeader udpHeader;
+    udpHeader.SetSourcePort(1024 + (flow & 0xfff));
+    udpHeader.SetDestinationPort(5000);
+    p->AddHeader(udpHeader);
+
+    Ipv4Header ipHeader;
+    ipHeader.SetSource(Ipv4Address(0x0a000000 + (flow >> 12)));
+    ipHeader.SetDestination(Ipv4Address("10.255.0.1"));
+    ipHeader.SetProtocol(UdpL4Protocol::PROT_NUMBER);
+    ipHeader.SetPayloadSize(p->GetSize());
+    ipHeader.SetTtl(64);
+    return Create<Ipv4QueueDiscItem>(p, Address(), Ipv4L3Protocol::PROT_NUMBER, ipHeader);
+}
+
+int
+main(int argc, char* argv[])
+{
+    uint32_t buckets = 65536;
+    uint32_t maxFlows = 1048576;
+    uint64_t packets = 10000000;
+    uint32_t size = 100;
+
+    CommandLine cmd(__FILE__);
+    cmd.AddValue("buckets", "Number of flow queues of the queue disc", buckets);
+    cmd.AddValue("maxFlows", "Largest number of flows to test", maxFlows);
+    cmd.AddValue("packets", "Number of packets to enqueue and dequeue", packets);
+    cmd.AddValue("size", "Payload size of the packets in bytes", size);
+    cmd.Parse(argc, argv);
+
+    std::cout << "Crc32c computed with "
+              << (LLQQueueDisc::IsCrc32cHardwareAccelerated() ? "the SSE4.2 crc32 instruction"
+                                                              : "slicing-by-8 tables")
+              << std::endl;
+
+    Ptr<UniformRandomVariable> random = CreateObject<UniformRandomVariable>();
+
+    for (std::string hash : {"Default", "Crc32c", "Mix64"})
+    {
+        for (uint32_t flows : {1000, 65536, 1048576})
+        {
+            if (flows > maxFlows)
+            {
+                continue;
+            }
+
+            Ptr<LLQQueueDisc> qdisc = CreateObject<LLQQueueDisc>();
+            qdisc->SetAttribute("Flows", UintegerValue(buckets));
+            qdisc->SetAttribute("EnableSetAssociativeHash", BooleanValue(false));
+            qdisc->SetAttribute("HashFunction", StringValue(hash));
+            qdisc->SetAttribute("FlowAqm", StringValue("CoDel"));
+            qdisc->SetAttribute("MaxSize",
+                                QueueSizeValue(QueueSize(QueueSizeUnit::PACKETS, flows + 1)));
+            qdisc->SetQuantum(1500);
+            qdisc->Initialize();
+
+            for (uint32_t flow = 0; flow < flows; flow++)
+            {
+                qdisc->Enqueue(CreateItem(flow, size));
+            }
+
+            uint32_t used = qdisc->GetNQueueDiscClasses();
+            uint32_t maxLoad = 0;
+            for (uint32_t i = 0; i < used; i++)
+            {
+                Ptr<QueueDisc> flowQueue = qdisc->GetQueueDiscClass(i)->GetQueueDisc();
+                maxLoad = std::max(maxLoad, flowQueue->GetNPackets());
+            }
+            double expectedUsed = buckets * (1 - std::pow(1 - 1.0 / buckets, flows));
+
+            while (qdisc->Dequeue())
+            {
+            }
+
+            std::vector<Ptr<QueueDiscItem>> items;
+            for (uint32_t i = 0; i < std::min(flows, 65536U); i++)
+            {
+                items.push_back(CreateItem(random->GetInteger(0, flows - 1), size));
+            }
+
+            auto start = std::chrono::steady_clock::now();
+
+            for (uint64_t n = 0; n < packets; n++)
+            {
+                qdisc->Enqueue(items[n % items.size()]);
+                qdisc->Dequeue();
+            }
+
+            std::chrono::duration<double, std::nano> elapsed =
+                std::chrono::steady_clock::now() - start;
+
+            std::cout << hash << ", " << flows << " flows: " << used << " queues used ("
+                      << expectedUsed << " expected), at most " << maxLoad
+                      << " flows per queue (mean " << double(flows) / buckets << "), "
+                      << elapsed.count() / packets << " ns per enqueue and dequeue" << std::endl;
+
+            qdisc->Dispose();
+        }
+    }
+
+    Simulator::Destroy();
+    return 0;
+}
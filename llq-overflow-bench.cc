@@ -0,0 +1,118 @@
+/*
+ * Microbenchmark of the overload handling of LLQQueueDisc.
+ *
+ * A LLQQueueDisc with 64k flow queues is filled up to its limit with one
+ * packet per flow, plus a backlog for a few fat flows. Then packets of random
+ * flows are enqueued in batches: every enqueue exceeds the limit and makes
+ * LLQDrop find the fattest flow and drop a packet from its head. The average
+ * cost of an overflowing enqueue is reported. Running the program on a tree
+ * before and after a change of the fat flow lookup gives the cost of the two
+ * implementations.
+ *
+ * Usage: ./ns3 run "llq-overflow-bench --flows=65536 --packets=1000000"
+ */
+
+#include "ns3/core-module.h"
+#include "ns3/internet-module.h"
+#include "ns3/llq-queue-disc.h"
+#include "ns3/network-module.h"
+#include "ns3/traffic-control-module.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+using namespace ns3;
+
+/**
+ * Create a UDP packet of a flow.
+ *
+ * \param flow the flow, which gives the source address and port of the packet
+ * \param size the payload size
+ * \return the packet
+ */
+static Ptr<QueueDiscItem>
+CreateItem(uint32_t flow, uint32_t size)
+{
+    Ptr<Packet> p = Create<Packet>(size);
+    UdpHeader udpHeader;
+    udpHeader.SetSourcePort(1024 + (flow & 0xfff));
+    udpHeader.SetDestinationPort(5000);
+    p->AddHeader(udpHeader);
+
+    Ipv4Header ipHeader;
+    ipHeader.SetSource(Ipv4Address(0x0a000000 + (flow >> 12)));
+    ipHeader.SetDestination(Ipv4Address("10.255.0.1"));
+    ipHeader.SetProtocol(UdpL4Protocol::PROT_NUMBER);
+    ipHeader.SetPayloadSize(p->GetSize());
+    ipHeader.SetTtl(64);
+    return Create<Ipv4QueueDiscItem>(p, Address(), Ipv4L3Protocol::PROT_NUMBER, ipHeader);
+}
+
+int
+main(int argc, char* argv[])
+{
+    uint32_t flows = 65536;
+    uint32_t fatFlows = 16;
+    uint32_t fatBacklog = 64;
+    uint64_t packets = 1000000;
+    uint32_t batch = 10000;
+    uint32_t size = 500;
+
+    CommandLine cmd(__FILE__);
+    cmd.AddValue("flows", "Number of flows, each with a queued packet", flows);
+    cmd.AddValue("fatFlows", "Number of flows with a larger backlog", fatFlows);
+    cmd.AddValue("fatBacklog", "Number of packets queued in each fat flow", fatBacklog);
+    cmd.AddValue("packets", "Number of overflowing packets to enqueue", packets);
+    cmd.AddValue("batch", "Number of packets created before each timed batch", batch);
+    cmd.AddValue("size", "Payload size of the packets in bytes", size);
+    cmd.Parse(argc, argv);
+
+    uint32_t limit = flows + fatFlows * (fatBacklog - 1);
+
+    Ptr<LLQQueueDisc> qdisc = CreateObject<LLQQueueDisc>();
+    qdisc->SetAttribute("Flows", UintegerValue(flows));
+    qdisc->SetAttribute("MaxSize", QueueSizeValue(QueueSize(QueueSizeUnit::PACKETS, limit)));
+    qdisc->SetAttribute("DropBatchSize", UintegerValue(1));
+    qdisc->SetQuantum(1500);
+    qdisc->Initialize();
+
+    for (uint32_t flow = 0; flow < flows; flow++)
+    {
+        uint32_t backlog = (flow < fatFlows ? fatBacklog : 1);
+        for (uint32_t i = 0; i < backlog; i++)
+        {
+            qdisc->Enqueue(CreateItem(flow, size));
+        }
+    }
+
+    Ptr<UniformRandomVariable> random = CreateObject<UniformRandomVariable>();
+    std::vector<Ptr<QueueDiscItem>> items;
+    items.reserve(batch);
+    std::chrono::duration<double, std::nano> elapsed(0);
+
+    for (uint64_t n = 0; n < packets; n += batch)
+    {
+        items.clear();
+        for (uint64_t i = n; i < std::min(packets, n + batch); i++)
+        {
+            items.push_back(CreateItem(random->GetInteger(0, flows - 1), size));
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for (auto& item : items)
+        {
+            qdisc->Enqueue(item);
+        }
+        elapsed += std::chrono::steady_clock::now() - start;
+    }
+
+    std::cout << qdisc->GetNQueueDiscClasses() << " flow queues, " << packets
+              << " packets enqueued, " << qdisc->GetStats().nTotalDroppedPackets
+              << " packets dropped, " << elapsed.count() / packets << " ns per enqueue"
+              << std::endl;
+
+    Simulator::Destroy();
+    return 0;
+}
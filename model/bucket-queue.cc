@@ -0,0 +1,229 @@
+#include "bucket-queue.h"
+
+#include "ns3/abort.h"
+#include "ns3/log.h"
+
+namespace ns3
+{
+
+NS_LOG_COMPONENT_DEFINE("BucketQueue");
+
+BucketQueue::BucketQueue()
+    : m_words{},
+      m_summary(0),
+      m_mask(0),
+      m_shift(0),
+      m_baseRank(0),
+      m_baseBucket(0),
+      m_size(0)
+{
+}
+
+void
+BucketQueue::Init(uint32_t nIds, uint32_t nBuckets, uint32_t shift)
+{
+    NS_LOG_FUNCTION(this << nIds << nBuckets << shift);
+
+    NS_ABORT_MSG_IF(nBuckets == 0 || nBuckets > MAX_BUCKETS || (nBuckets & (nBuckets - 1)),
+                    "The number of buckets must be a power of two up to " << MAX_BUCKETS);
+    NS_ABORT_MSG_IF(shift >= 64, "Too many ranks per bucket");
+
+    m_next.assign(nIds, NONE);
+    m_prev.assign(nIds, NONE);
+    m_bucketOf.assign(nIds, NONE);
+    m_rank.assign(nIds, 0);
+    m_head.assign(nBuckets, NONE);
+    m_tail.assign(nBuckets, NONE);
+    m_words.fill(0);
+    m_summary = 0;
+    m_mask = nBuckets - 1;
+    m_shift = shift;
+    m_baseRank = 0;
+    m_baseBucket = 0;
+    m_size = 0;
+}
+
+void
+BucketQueue::Push(uint32_t id, uint64_t rank)
+{
+    NS_LOG_FUNCTION(this << id << rank);
+
+    NS_ASSERT_MSG(id < m_bucketOf.size() && m_bucketOf[id] == NONE, "Invalid identifier");
+
+    if (m_size == 0)
+    {
+        // start the window at the bucket of the rank
+        m_baseRank = rank >> m_shift << m_shift;
+    }
+
+    int64_t distance = static_cast<int64_t>(rank - m_baseRank);
+    uint64_t offset = (distance < 0 ? 0 : static_cast<uint64_t>(distance) >> m_shift);
+    if (offset > m_mask)
+    {
+        offset = m_mask;
+    }
+    uint32_t bucket = (m_baseBucket + offset) & m_mask;
+
+    m_rank[id] = rank;
+    m_bucketOf[id] = bucket;
+    m_next[id] = NONE;
+    m_prev[id] = m_tail[bucket];
+
+    if (m_tail[bucket] == NONE)
+    {
+        m_head[bucket] = id;
+        m_words[bucket >> 6] |= (uint64_t(1) << (bucket & 63));
+        m_summary |= (uint64_t(1) << (bucket >> 6));
+    }
+    else
+    {
+        m_next[m_tail[bucket]] = id;
+    }
+    m_tail[bucket] = id;
+    m_size++;
+}
+
+void
+BucketQueue::Remove(uint32_t id)
+{
+    NS_LOG_FUNCTION(this << id);
+
+    NS_ASSERT_MSG(Contains(id), "Identifier not queued");
+
+    uint32_t bucket = m_bucketOf[id];
+
+    if (m_prev[id] == NONE)
+    {
+        m_head[bucket] = m_next[id];
+    }
+    else
+    {
+        m_next[m_prev[id]] = m_next[id];
+    }
+
+    if (m_next[id] == NONE)
+    {
+        m_tail[bucket] = m_prev[id];
+    }
+    else
+    {
+        m_prev[m_next[id]] = m_prev[id];
+    }
+
+    if (m_head[bucket] == NONE)
+    {
+        m_words[bucket >> 6] &= ~(uint64_t(1) << (bucket & 63));
+        if (!m_words[bucket >> 6])
+        {
+            m_summary &= ~(uint64_t(1) << (bucket >> 6));
+        }
+    }
+
+    m_bucketOf[id] = NONE;
+    m_size--;
+}
+
+uint32_t
+BucketQueue::Pop()
+{
+    NS_LOG_FUNCTION(this);
+
+    uint32_t id = GetFirst();
+    if (id != NONE)
+    {
+        Remove(id);
+    }
+    return id;
+}
+
+uint32_t
+BucketQueue::GetFirst()
+{
+    uint32_t bucket = FindBucket(m_baseBucket);
+
+    if (bucket == NONE)
+    {
+        return NONE;
+    }
+
+    // slide the window to the first non-empty bucket
+    m_baseRank += static_cast<uint64_t>(GetOffset(bucket)) << m_shift;
+    m_baseBucket = bucket;
+    return m_head[bucket];
+}
+
+uint32_t
+BucketQueue::GetNext(uint32_t id) const
+{
+    NS_ASSERT_MSG(Contains(id), "Identifier not queued");
+
+    if (m_next[id] != NONE)
+    {
+        return m_next[id];
+    }
+
+    uint32_t bucket = FindBucket((m_bucketOf[id] + 1) & m_mask);
+
+    // stop at the end of the window
+    if (bucket == NONE || GetOffset(bucket) <= GetOffset(m_bucketOf[id]))
+    {
+        return NONE;
+    }
+    return m_head[bucket];
+}
+
+bool
+BucketQueue::Contains(uint32_t id) const
+{
+    return id < m_bucketOf.size() && m_bucketOf[id] != NONE;
+}
+
+uint64_t
+BucketQueue::GetRank(uint32_t id) const
+{
+    NS_ASSERT_MSG(Contains(id), "Identifier not queued");
+
+    return m_rank[id];
+}
+
+uint32_t
+BucketQueue::GetSize() const
+{
+    return m_size;
+}
+
+uint32_t
+BucketQueue::FindBucket(uint32_t from) const
+{
+    uint32_t word = from >> 6;
+    uint64_t bits = m_words[word] & (~uint64_t(0) << (from & 63));
+
+    if (bits)
+    {
+        return (word << 6) | __builtin_ctzll(bits);
+    }
+
+    uint64_t words = (word < 63 ? m_summary & (~uint64_t(0) << (word + 1)) : 0);
+
+    // wrap around if no bucket follows
+    if (!words)
+    {
+        words = m_summary;
+    }
+
+    if (!words)
+    {
+        return NONE;
+    }
+
+    word = __builtin_ctzll(words);
+    return (word << 6) | __builtin_ctzll(m_words[word]);
+}
+
+uint32_t
+BucketQueue::GetOffset(uint32_t bucket) const
+{
+    return (bucket - m_baseBucket) & m_mask;
+}
+
+} // namespace ns3
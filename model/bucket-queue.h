@@ -0,0 +1,125 @@
+#ifndef BUCKET_QUEUE_H
+#define BUCKET_QUEUE_H
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace ns3
+{
+
+/**
+ * \ingroup traffic-control
+ *
+ * \brief Approximate priority queue of identifiers ordered by rank, after the
+ * circular FFS-based queue of Eiffel.
+ *
+ * The ranks are mapped to buckets of 2^shift ranks each. The buckets cover a
+ * window starting at the bucket of the smallest rank; ranks beyond the window
+ * fall into its last bucket and ranks before it into its first bucket. Each
+ * bucket is a FIFO list of identifiers and the non-empty buckets are tracked
+ * by a two-level bitmap searched with find-first-set instructions, so that
+ * pushing, removing and finding the first identifier take constant time.
+ *
+ * Identifiers are small integers (e.g., band or flow indices) and each of them
+ * can be queued at most once. Ranks may wrap around: they are only compared
+ * through the sign of their difference.
+ */
+class BucketQueue
+{
+  public:
+    static constexpr uint32_t NONE = UINT32_MAX;  //!< No identifier
+    static constexpr uint32_t MAX_BUCKETS = 4096; //!< Maximum number of buckets
+
+    BucketQueue();
+
+    /**
+     * \brief Empty the queue and set its size
+     * \param nIds the number of identifiers, which range from 0 to nIds - 1
+     * \param nBuckets the number of buckets (a power of two up to MAX_BUCKETS)
+     * \param shift the base-2 logarithm of the number of ranks per bucket
+     */
+    void Init(uint32_t nIds, uint32_t nBuckets, uint32_t shift);
+
+    /**
+     * \brief Add an identifier that is not queued
+     * \param id the identifier
+     * \param rank the rank of the identifier
+     */
+    void Push(uint32_t id, uint64_t rank);
+
+    /**
+     * \brief Remove a queued identifier
+     * \param id the identifier
+     */
+    void Remove(uint32_t id);
+
+    /**
+     * \brief Remove the first identifier
+     * \return the identifier (NONE if the queue is empty)
+     */
+    uint32_t Pop();
+
+    /**
+     * \brief Get the first identifier, i.e., the oldest one in the first
+     * non-empty bucket
+     * \return the identifier (NONE if the queue is empty)
+     */
+    uint32_t GetFirst();
+
+    /**
+     * \brief Get the identifier following a queued one, in bucket order
+     * \param id the identifier
+     * \return the following identifier (NONE if id is the last one)
+     */
+    uint32_t GetNext(uint32_t id) const;
+
+    /**
+     * \param id the identifier
+     * \return true if the identifier is queued
+     */
+    bool Contains(uint32_t id) const;
+
+    /**
+     * \param id a queued identifier
+     * \return the rank of the identifier
+     */
+    uint64_t GetRank(uint32_t id) const;
+
+    /**
+     * \return the number of queued identifiers
+     */
+    uint32_t GetSize() const;
+
+  private:
+    /**
+     * \brief Find the first non-empty bucket, in circular order from a bucket
+     * \param from the bucket to start from
+     * \return the bucket (NONE if all the buckets are empty)
+     */
+    uint32_t FindBucket(uint32_t from) const;
+
+    /**
+     * \param bucket a bucket
+     * \return the position of the bucket in the window
+     */
+    uint32_t GetOffset(uint32_t bucket) const;
+
+    std::vector<uint32_t> m_next;     //!< Next identifier in the bucket of each identifier
+    std::vector<uint32_t> m_prev;     //!< Previous identifier in the bucket of each identifier
+    std::vector<uint32_t> m_bucketOf; //!< Bucket of each identifier (NONE if not queued)
+    std::vector<uint64_t> m_rank;     //!< Rank of each identifier
+    std::vector<uint32_t> m_head;     //!< First identifier of each bucket
+    std::vector<uint32_t> m_tail;     //!< Last identifier of each bucket
+    std::array<uint64_t, 64> m_words; //!< Bitmap of the non-empty buckets
+    uint64_t m_summary;               //!< Bitmap of the non-empty words of m_words
+    uint32_t m_mask;                  //!< Number of buckets minus one
+    uint32_t m_shift;                 //!< Base-2 logarithm of the ranks per bucket
+    uint64_t m_baseRank;              //!< First rank of the first bucket of the window
+    uint32_t m_baseBucket;            //!< First bucket of the window
+    uint32_t m_size;                  //!< Number of queued identifiers
+};
+
+} // namespace ns3
+
+#endif /* BUCKET_QUEUE_H */
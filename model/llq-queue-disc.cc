@@ -2,16 +2,250 @@
 
 #include "pie-queue-disc.h"
 
+#include "ns3/drop-tail-queue.h"
+#include "ns3/enum.h"
+#include "ns3/ipv4-queue-disc-item.h"
+#include "ns3/ipv6-queue-disc-item.h"
 #include "ns3/log.h"
 #include "ns3/net-device-queue-interface.h"
 #include "ns3/queue.h"
+#include "ns3/simulator.h"
 #include "ns3/string.h"
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#include <limits>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#endif
+
 namespace ns3
 {
 
 NS_LOG_COMPONENT_DEFINE("LLQQueueDisc");
 
+/**
+ * \brief Get the 5-tuple of an IPv4 or IPv6 packet as 64-bit words, without
+ * serializing its headers
+ * \param item the packet
+ * \param words the words (room for 5)
+ * \return the number of words (0 if the packet is neither IPv4 nor IPv6)
+ */
+static uint32_t
+GetFlowWords(Ptr<QueueDiscItem> item, uint64_t* words)
+{
+    uint8_t protocol;
+    bool hasPorts;
+    uint32_t n;
+
+    if (item->GetProtocol() == 0x0800)
+    {
+        const Ipv4Header& header =
+            static_cast<const Ipv4QueueDiscItem*>(PeekPointer(item))->GetHeader();
+        words[0] = (static_cast<uint64_t>(header.GetSource().Get()) << 32) |
+                   header.GetDestination().Get();
+        n = 1;
+        protocol = header.GetProtocol();
+        hasPorts = (header.GetFragmentOffset() == 0);
+    }
+    else if (item->GetProtocol() == 0x86DD)
+    {
+        const Ipv6Header& header =
+            static_cast<const Ipv6QueueDiscItem*>(PeekPointer(item))->GetHeader();
+        uint8_t addresses[32];
+        header.GetSource().GetBytes(addresses);
+        header.GetDestination().GetBytes(addresses + 16);
+        std::memcpy(words, addresses, sizeof(addresses));
+        n = 4;
+        protocol = header.GetNextHeader();
+        hasPorts = true;
+    }
+    else
+    {
+        return 0;
+    }
+
+    // the ports are the first four bytes of both the TCP and the UDP headers
+    uint8_t ports[4] = {0, 0, 0, 0};
+    if (hasPorts && (protocol == 6 || protocol == 17))
+    {
+        item->GetPacket()->CopyData(ports, sizeof(ports));
+    }
+    uint32_t portWord;
+    std::memcpy(&portWord, ports, sizeof(ports));
+    words[n++] = (static_cast<uint64_t>(portWord) << 8) | protocol;
+    return n;
+}
+
+/**
+ * \brief Get the lookup tables of the slicing-by-8 CRC32C (reflected
+ * Castagnoli polynomial): entry i of table k is the CRC of byte i followed by
+ * k zero bytes
+ * \return the tables
+ */
+static const std::array<std::array<uint32_t, 256>, 8>&
+GetCrc32cTables()
+{
+    static const auto tables = [] {
+        std::array<std::array<uint32_t, 256>, 8> t{};
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+            for (uint32_t bit = 0; bit < 8; bit++)
+            {
+                crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+            }
+            t[0][i] = crc;
+        }
+        for (uint32_t k = 1; k < 8; k++)
+        {
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+            }
+        }
+        return t;
+    }();
+    return tables;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/**
+ * \brief Compute the CRC32C of 64-bit words with the SSE4.2 crc32 instruction.
+ * Only call it if the CPU supports SSE4.2
+ * \param words the words
+ * \param n the number of words
+ * \param seed the initial value of the CRC
+ * \return the CRC
+ */
+__attribute__((target("sse4.2"))) static uint32_t
+Crc32cSse42(const uint64_t* words, uint32_t n, uint32_t seed)
+{
+    uint64_t crc = seed;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        crc = _mm_crc32_u64(crc, words[i]);
+    }
+    return static_cast<uint32_t>(crc);
+}
+#endif
+
+/**
+ * \brief Check whether the CPU has the SSE4.2 crc32 instruction
+ * \return true if the CPU has the crc32 instruction
+ */
+static bool
+HasCrc32cInstruction()
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+    static const bool supported = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.2") != 0;
+    }();
+    return supported;
+#else
+    return false;
+#endif
+}
+
+/**
+ * \brief Compute the CRC32C of 64-bit words, with the crc32 instruction if the
+ * CPU has it and eight table lookups per word otherwise
+ * \param words the words
+ * \param n the number of words
+ * \param seed the initial value of the CRC
+ * \return the CRC
+ */
+static uint32_t
+Crc32c(const uint64_t* words, uint32_t n, uint32_t seed)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (HasCrc32cInstruction())
+    {
+        return Crc32cSse42(words, n, seed);
+    }
+#endif
+    // slicing-by-8: the bytes of a word are little-endian, as for the instruction
+    const auto& t = GetCrc32cTables();
+    uint32_t crc = seed;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint64_t x = words[i] ^ crc;
+        crc = t[7][x & 0xff] ^ t[6][(x >> 8) & 0xff] ^ t[5][(x >> 16) & 0xff] ^
+              t[4][(x >> 24) & 0xff] ^ t[3][(x >> 32) & 0xff] ^ t[2][(x >> 40) & 0xff] ^
+              t[1][(x >> 48) & 0xff] ^ t[0][x >> 56];
+    }
+    return crc;
+}
+
+/**
+ * \brief Mix 64-bit words into a 32-bit hash with multiplications and xorshifts
+ * \param words the words
+ * \param n the number of words
+ * \param seed the seed of the hash
+ * \return the hash
+ */
+static uint32_t
+Mix64(const uint64_t* words, uint32_t n, uint32_t seed)
+{
+    uint64_t h = seed;
+    for (uint32_t i = 0; i < n; i++)
+    {
+        h = (h ^ words[i]) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 32;
+    }
+    // SplitMix64 finalizer
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    return static_cast<uint32_t>((h ^ (h >> 31)) >> 32);
+}
+
+/**
+ * \brief Find the ways of a set whose tag matches a flow hash
+ * \param tags the tags of the set
+ * \param ways the number of ways of the set (at most 64)
+ * \param flowHash the flow hash
+ * \return the bitmap of the matching ways
+ */
+static inline uint64_t
+MatchTags(const uint32_t* tags, uint32_t ways, uint32_t flowHash)
+{
+#ifdef __AVX2__
+    if (ways == 8)
+    {
+        __m256i cmp = _mm256_cmpeq_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(tags)),
+                                         _mm256_set1_epi32(static_cast<int>(flowHash)));
+        return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(cmp)));
+    }
+#elif defined(__SSE2__)
+    if (ways == 8)
+    {
+        __m128i key = _mm_set1_epi32(static_cast<int>(flowHash));
+        __m128i lo = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(tags)), key);
+        __m128i hi =
+            _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(tags + 4)), key);
+        return static_cast<uint32_t>(_mm_movemask_ps(_mm_castsi128_ps(lo)) |
+                                     (_mm_movemask_ps(_mm_castsi128_ps(hi)) << 4));
+    }
+#endif
+    uint64_t match = 0;
+    for (uint32_t i = 0; i < ways; i++)
+    {
+        match |= static_cast<uint64_t>(tags[i] == flowHash) << i;
+    }
+    return match;
+}
+
 NS_OBJECT_ENSURE_REGISTERED(LLQFlow);
 
 TypeId
@@ -27,7 +261,8 @@ LLQFlow::GetTypeId()
 LLQFlow::LLQFlow()
     : m_deficit(0),
       m_status(INACTIVE),
-      m_index(0)
+      m_index(0),
+      m_next(nullptr)
 {
     NS_LOG_FUNCTION(this);
 }
@@ -85,6 +320,76 @@ LLQFlow::GetIndex() const
     return m_index;
 }
 
+NS_OBJECT_ENSURE_REGISTERED(LLQPoolQueue);
+
+TypeId
+LLQPoolQueue::GetTypeId()
+{
+    static TypeId tid = TypeId("ns3::LLQPoolQueue")
+                            .SetParent<Queue<QueueDiscItem>>()
+                            .SetGroupName("TrafficControl")
+                            .AddConstructor<LLQPoolQueue>();
+    return tid;
+}
+
+LLQPoolQueue::LLQPoolQueue()
+{
+    NS_LOG_FUNCTION(this);
+}
+
+LLQPoolQueue::~LLQPoolQueue()
+{
+    NS_LOG_FUNCTION(this);
+}
+
+bool
+LLQPoolQueue::Enqueue(Ptr<QueueDiscItem> item)
+{
+    NS_LOG_FUNCTION(this << item);
+    return DoEnqueue(end(), item);
+}
+
+bool
+LLQPoolQueue::Enqueue(Ptr<QueueDiscItem> item, ConstIterator& pos)
+{
+    NS_LOG_FUNCTION(this << item);
+
+    if (!DoEnqueue(end(), item))
+    {
+        return false;
+    }
+    pos = std::prev(GetContainer().end());
+    return true;
+}
+
+Ptr<QueueDiscItem>
+LLQPoolQueue::Dequeue()
+{
+    NS_LOG_FUNCTION(this);
+    return DoDequeue(begin());
+}
+
+Ptr<QueueDiscItem>
+LLQPoolQueue::Dequeue(ConstIterator pos)
+{
+    NS_LOG_FUNCTION(this);
+    return DoDequeue(pos);
+}
+
+Ptr<QueueDiscItem>
+LLQPoolQueue::Remove()
+{
+    NS_LOG_FUNCTION(this);
+    return DoRemove(begin());
+}
+
+Ptr<const QueueDiscItem>
+LLQPoolQueue::Peek() const
+{
+    NS_LOG_FUNCTION(this);
+    return DoPeek(begin());
+}
+
 NS_OBJECT_ENSURE_REGISTERED(LLQQueueDisc);
 
 TypeId
@@ -192,23 +497,144 @@ LLQQueueDisc::GetTypeId()
                           MakeUintegerAccessor(&LLQQueueDisc::m_perturbation),
                           MakeUintegerChecker<uint32_t>())
             .AddAttribute("EnableSetAssociativeHash",
-                          "Enable/Disable Set Associative Hash",
+                          "Enable/Disable Set Associative Hash (requires Flows to be a multiple "
+                          "of SetWays)",
                           BooleanValue(false),
                           MakeBooleanAccessor(&LLQQueueDisc::m_enableSetAssociativeHash),
                           MakeBooleanChecker())
+            .AddAttribute("HashFunction",
+                          "The hash function used to classify packets into flows, when no "
+                          "packet filter is installed",
+                          EnumValue(LLQQueueDisc::DEFAULT_HASH),
+                          MakeEnumAccessor<HashFunctionType>(&LLQQueueDisc::m_hashFunction),
+                          MakeEnumChecker(LLQQueueDisc::DEFAULT_HASH,
+                                          "Default",
+                                          LLQQueueDisc::CRC32C,
+                                          "Crc32c",
+                                          LLQQueueDisc::MIX64,
+                                          "Mix64"))
             .AddAttribute("SetWays",
                           "The size of a set of queues (used by set associative hash)",
                           UintegerValue(8),
                           MakeUintegerAccessor(&LLQQueueDisc::m_setWays),
-                          MakeUintegerChecker<uint32_t>());
+                          MakeUintegerChecker<uint32_t>())
+            .AddAttribute("IdleTimeout",
+                          "The time after which an inactive flow is reclaimed and its bucket "
+                          "freed for other flows (zero to never reclaim flows; otherwise "
+                          "requires FlowAqm to be SharedPie, CoDel or None)",
+                          TimeValue(Seconds(0)),
+                          MakeTimeAccessor(&LLQQueueDisc::m_idleTimeout),
+                          MakeTimeChecker())
+            .AddAttribute("PriorityQueue",
+                          "True to serve the packets with a priority DSCP (EF by default) "
+                          "from a policed priority queue, before the flows",
+                          BooleanValue(false),
+                          MakeBooleanAccessor(&LLQQueueDisc::m_usePriorityQueue),
+                          MakeBooleanChecker())
+            .AddAttribute("PriorityDscps",
+                          "The bitmap of the DSCPs served by the priority queue, bit i being "
+                          "set for DSCP i (EF, i.e., bit 46, by default)",
+                          UintegerValue(uint64_t(1) << 46),
+                          MakeUintegerAccessor(&LLQQueueDisc::m_priorityDscps),
+                          MakeUintegerChecker<uint64_t>())
+            .AddAttribute("PriorityRate",
+                          "The rate of the token bucket policing the priority queue",
+                          DataRateValue(DataRate("1Mbps")),
+                          MakeDataRateAccessor(&LLQQueueDisc::m_priorityRate),
+                          MakeDataRateChecker())
+            .AddAttribute("PriorityBurst",
+                          "The size in bytes of the token bucket policing the priority queue",
+                          UintegerValue(6000),
+                          MakeUintegerAccessor(&LLQQueueDisc::m_priorityBurst),
+                          MakeUintegerChecker<uint32_t>())
+            .AddAttribute("DualQueue",
+                          "True to queue the L4S (ECT(1) and CE) packets apart from the flows, "
+                          "with a coupled AQM (DualPI2) which alone manages the classic traffic "
+                          "(requires FlowAqm to be None)",
+                          BooleanValue(false),
+                          MakeBooleanAccessor(&LLQQueueDisc::m_useDualQueue),
+                          MakeBooleanChecker())
+            .AddAttribute("DualTarget",
+                          "The target queue delay of the classic traffic of the dual queue",
+                          TimeValue(MilliSeconds(15)),
+                          MakeTimeAccessor(&LLQQueueDisc::m_dualTarget),
+                          MakeTimeChecker())
+            .AddAttribute("DualAlpha",
+                          "The integral gain (Hz) of the PI controller of the dual queue",
+                          DoubleValue(0.16),
+                          MakeDoubleAccessor(&LLQQueueDisc::m_dualAlpha),
+                          MakeDoubleChecker<double>(0))
+            .AddAttribute("DualBeta",
+                          "The proportional gain (Hz) of the PI controller of the dual queue",
+                          DoubleValue(3.2),
+                          MakeDoubleAccessor(&LLQQueueDisc::m_dualBeta),
+                          MakeDoubleChecker<double>(0))
+            .AddAttribute("CouplingFactor",
+                          "The coupling factor between the classic and L4S probabilities",
+                          DoubleValue(2),
+                          MakeDoubleAccessor(&LLQQueueDisc::m_couplingFactor),
+                          MakeDoubleChecker<double>(0))
+            .AddAttribute("StepThreshold",
+                          "The sojourn time above which L4S packets are marked",
+                          TimeValue(MilliSeconds(1)),
+                          MakeTimeAccessor(&LLQQueueDisc::m_stepThreshold),
+                          MakeTimeChecker())
+            .AddAttribute("TimeShift",
+                          "The time added to the sojourn time of L4S packets when choosing "
+                          "between the L4S and the classic traffic",
+                          TimeValue(MilliSeconds(30)),
+                          MakeTimeAccessor(&LLQQueueDisc::m_timeShift),
+                          MakeTimeChecker())
+            .AddAttribute("FlowAqm",
+                          "The active queue management applied to each flow",
+                          EnumValue(LLQQueueDisc::CHILD_PIE),
+                          MakeEnumAccessor<FlowAqmType>(&LLQQueueDisc::m_flowAqm),
+                          MakeEnumChecker(LLQQueueDisc::CHILD_PIE,
+                                          "ChildPie",
+                                          LLQQueueDisc::SHARED_PIE,
+                                          "SharedPie",
+                                          LLQQueueDisc::CODEL,
+                                          "CoDel",
+                                          LLQQueueDisc::NONE,
+                                          "None"))
+            .AddAttribute("CoDelTarget",
+                          "The CoDel target queue delay of each flow (FlowAqm CoDel)",
+                          TimeValue(MilliSeconds(5)),
+                          MakeTimeAccessor(&LLQQueueDisc::m_codelTarget),
+                          MakeTimeChecker())
+            .AddAttribute("CoDelInterval",
+                          "The CoDel interval of each flow (FlowAqm CoDel)",
+                          TimeValue(MilliSeconds(100)),
+                          MakeTimeAccessor(&LLQQueueDisc::m_codelInterval),
+                          MakeTimeChecker())
+            .AddAttribute("UseFlowPool",
+                          "True to preallocate the state of all the flows at initialization "
+                          "instead of creating a flow queue with a PIE queue disc on the first "
+                          "packet of each flow (requires FlowAqm to be SharedPie, CoDel or None)",
+                          BooleanValue(false),
+                          MakeBooleanAccessor(&LLQQueueDisc::m_useFlowPool),
+                          MakeBooleanChecker())
+            .AddTraceSource("LiveFlows",
+                            "Number of flows whose state is allocated",
+                            MakeTraceSourceAccessor(&LLQQueueDisc::m_liveFlows),
+                            "ns3::TracedValueCallback::Uint32");
     return tid;
 }
 
 LLQQueueDisc::LLQQueueDisc()
     : QueueDisc(QueueDiscSizePolicy::MULTIPLE_QUEUES, QueueSizeUnit::PACKETS),
-      m_quantum(0)
+      m_quantum(0),
+      m_priorityDscps(uint64_t(1) << 46),
+      m_priorityTokens(0),
+      m_baseProb(0),
+      m_classicDelayOld(0),
+      m_pieCount(0),
+      m_newPool{NO_CLASS, NO_CLASS},
+      m_oldPool{NO_CLASS, NO_CLASS},
+      m_slabFree(NO_CLASS)
 {
     NS_LOG_FUNCTION(this);
+    m_uv = CreateObject<UniformRandomVariable>();
 }
 
 LLQQueueDisc::~LLQQueueDisc()
@@ -229,6 +655,69 @@ LLQQueueDisc::GetQuantum() const
     return m_quantum;
 }
 
+uint32_t
+LLQQueueDisc::GetNLiveFlows() const
+{
+    return m_liveFlows;
+}
+
+bool
+LLQQueueDisc::IsCrc32cHardwareAccelerated()
+{
+    return HasCrc32cInstruction();
+}
+
+void
+LLQQueueDisc::SetPriorityDscp(uint8_t dscp, bool priority)
+{
+    NS_LOG_FUNCTION(this << dscp << priority);
+
+    NS_ASSERT_MSG(dscp < 64, "DSCP must be a value between 0 and 63");
+
+    if (priority)
+    {
+        m_priorityDscps |= (uint64_t(1) << dscp);
+    }
+    else
+    {
+        m_priorityDscps &= ~(uint64_t(1) << dscp);
+    }
+}
+
+bool
+LLQQueueDisc::IsPriorityDscp(uint8_t dscp) const
+{
+    NS_LOG_FUNCTION(this << dscp);
+
+    NS_ASSERT_MSG(dscp < 64, "DSCP must be a value between 0 and 63");
+
+    return (m_priorityDscps >> dscp) & 1;
+}
+
+int64_t
+LLQQueueDisc::AssignStreams(int64_t stream)
+{
+    NS_LOG_FUNCTION(this << stream);
+    m_uv->SetStream(stream);
+    return 1;
+}
+
+void
+LLQQueueDisc::DoDispose()
+{
+    NS_LOG_FUNCTION(this);
+    // the lists do not hold a reference to the flows disposed of with the classes
+    m_newFlows.clear();
+    m_oldFlows.clear();
+    m_uv = nullptr;
+    m_priorityQueue = nullptr;
+    m_l4sQueue = nullptr;
+    m_poolQueue = nullptr;
+    Simulator::Remove(m_pieUpdateEvent);
+    Simulator::Remove(m_dualUpdateEvent);
+    QueueDisc::DoDispose();
+}
+
 uint32_t
 LLQQueueDisc::SetAssociativeHash(uint32_t flowHash)
 {
@@ -238,25 +727,98 @@ LLQQueueDisc::SetAssociativeHash(uint32_t flowHash)
     uint32_t innerHash = h % m_setWays;
     uint32_t outerHash = h - innerHash;
 
-    for (uint32_t i = outerHash; i < outerHash + m_setWays; i++)
+    // the queues that have not been created yet or are inactive, and those
+    // associated with this flow, can be used
+    uint64_t ways = MatchTags(&m_flowTags[outerHash], m_setWays, flowHash) |
+                    ~m_activeWays[outerHash / m_setWays];
+    ways &= (m_setWays == 64 ? ~uint64_t(0) : (uint64_t(1) << m_setWays) - 1);
+
+    // if all the queues of the set are used, use the first queue of the set
+    uint32_t i = outerHash + (ways ? __builtin_ctzll(ways) : 0);
+    m_flowTags[i] = flowHash;
+    return i;
+}
+
+uint32_t
+LLQQueueDisc::GetFlowHash(Ptr<QueueDiscItem> item) const
+{
+    uint64_t words[5];
+    uint32_t n;
+
+    if (m_hashFunction == DEFAULT_HASH || !(n = GetFlowWords(item, words)))
+    {
+        return item->Hash(m_perturbation);
+    }
+
+    return (m_hashFunction == CRC32C ? Crc32c(words, n, m_perturbation)
+                                     : Mix64(words, n, m_perturbation));
+}
+
+void
+LLQQueueDisc::SetFlowActive(uint32_t index, bool active)
+{
+    if (!m_enableSetAssociativeHash)
+    {
+        return;
+    }
+
+    uint64_t bit = uint64_t(1) << (index % m_setWays);
+    uint64_t& set = m_activeWays[index / m_setWays];
+    set = (active ? set | bit : set & ~bit);
+}
+
+void
+LLQQueueDisc::UpdateBacklog(uint32_t index, uint32_t bytes)
+{
+    NS_LOG_FUNCTION(this << index << bytes);
+
+    if (index == m_backlog.size())
     {
-        auto it = m_flowsIndices.find(i);
+        m_backlog.push_back(0);
+        m_backlogPos.push_back(m_backlogHeap.size());
+        m_backlogHeap.push_back(index);
+    }
+
+    uint32_t old = m_backlog[index];
+    uint32_t pos = m_backlogPos[index];
+    m_backlog[index] = bytes;
 
-        if (it == m_flowsIndices.end() ||
-            (m_tags.find(i) != m_tags.end() && m_tags[i] == flowHash) ||
-            StaticCast<LLQFlow>(GetQueueDiscClass(it->second))->GetStatus() ==
-                LLQFlow::INACTIVE)
+    auto swap = [this](uint32_t a, uint32_t b) {
+        std::swap(m_backlogHeap[a], m_backlogHeap[b]);
+        m_backlogPos[m_backlogHeap[a]] = a;
+        m_backlogPos[m_backlogHeap[b]] = b;
+    };
+
+    if (bytes > old)
+    {
+        // sift up
+        while (pos > 0 && m_backlog[m_backlogHeap[(pos - 1) / 2]] < bytes)
         {
-            // this queue has not been created yet or is associated with this flow
-            // or is inactive, hence we can use it
-            m_tags[i] = flowHash;
-            return i;
+            swap(pos, (pos - 1) / 2);
+            pos = (pos - 1) / 2;
         }
+        return;
     }
 
-    // all the queues of the set are used. Use the first queue of the set
-    m_tags[outerHash] = flowHash;
-    return outerHash;
+    // sift down
+    while (true)
+    {
+        uint32_t largest = pos;
+        for (uint32_t child = 2 * pos + 1; child <= 2 * pos + 2; child++)
+        {
+            if (child < m_backlogHeap.size() &&
+                m_backlog[m_backlogHeap[child]] > m_backlog[m_backlogHeap[largest]])
+            {
+                largest = child;
+            }
+        }
+        if (largest == pos)
+        {
+            return;
+        }
+        swap(pos, largest);
+        pos = largest;
+    }
 }
 
 bool
@@ -266,10 +828,34 @@ LLQQueueDisc::DoEnqueue(Ptr<QueueDiscItem> item)
 
     uint32_t flowHash;
     uint32_t h;
+    uint8_t tos = 0;
+
+    if ((m_priorityQueue || m_l4sQueue) && item->GetUint8Value(QueueItem::IP_DSFIELD, tos))
+    {
+        if (m_priorityQueue && ((m_priorityDscps >> (tos >> 2)) & 1))
+        {
+            return PriorityEnqueue(item);
+        }
+
+        // ECT(1) and CE packets
+        if (m_l4sQueue && (tos & 0x1))
+        {
+            return L4sEnqueue(item);
+        }
+    }
+
+    // the classic drop probability is the square of the base probability
+    if (m_l4sQueue && m_baseProb > 0 && m_uv->GetValue() < m_baseProb * m_baseProb &&
+        (!m_useEcn || !Mark(item, UNFORCED_MARK)))
+    {
+        NS_LOG_DEBUG("Classic packet dropped by the dual queue");
+        DropBeforeEnqueue(item, UNFORCED_DROP);
+        return false;
+    }
 
     if (GetNPacketFilters() == 0)
     {
-        flowHash = item->Hash(m_perturbation);
+        flowHash = GetFlowHash(item);
     }
     else
     {
@@ -296,8 +882,43 @@ LLQQueueDisc::DoEnqueue(Ptr<QueueDiscItem> item)
         h = flowHash % m_flows;
     }
 
+    if (m_flowAqm != CHILD_PIE)
+    {
+        item->SetTimeStamp(Simulator::Now());
+    }
+
+    if (m_useFlowPool)
+    {
+        return PoolEnqueue(item, h);
+    }
+
+    if (m_idleTimeout.IsStrictlyPositive())
+    {
+        ReclaimIdleFlows();
+    }
+
     Ptr<LLQFlow> flow;
-    if (m_flowsIndices.find(h) == m_flowsIndices.end())
+    uint32_t& classIndex = m_flowClass[h];
+    if (classIndex == NO_CLASS && !m_freeClasses.empty())
+    {
+        classIndex = m_freeClasses.back();
+        m_freeClasses.pop_back();
+        NS_LOG_DEBUG("Reusing the flow queue of class " << classIndex << " for index " << h);
+        flow = StaticCast<LLQFlow>(GetQueueDiscClass(classIndex));
+        flow->SetIndex(h);
+        m_liveFlows++;
+
+        // the AQM state of the flow previously served by the class is dropped
+        if (m_flowAqm == SHARED_PIE && m_pieSlot[classIndex] != NO_CLASS)
+        {
+            PieRelease(m_pieSlot[classIndex]);
+        }
+        else if (m_flowAqm == CODEL)
+        {
+            m_codel[classIndex] = CoDelState{Time(0), Time(0), 0, 0, false};
+        }
+    }
+    else if (classIndex == NO_CLASS)
     {
         NS_LOG_DEBUG("Creating a new flow queue with index " << h);
         flow = m_flowFactory.Create<LLQFlow>();
@@ -315,23 +936,33 @@ LLQQueueDisc::DoEnqueue(Ptr<QueueDiscItem> item)
         flow->SetIndex(h);
         AddQueueDiscClass(flow);
 
-        m_flowsIndices[h] = GetNQueueDiscClasses() - 1;
+        classIndex = GetNQueueDiscClasses() - 1;
+        m_idleSince.push_back(Time());
+        m_liveFlows++;
     }
     else
     {
-        flow = StaticCast<LLQFlow>(GetQueueDiscClass(m_flowsIndices[h]));
+        flow = StaticCast<LLQFlow>(GetQueueDiscClass(classIndex));
+    }
+
+    if (m_flowAqm == SHARED_PIE &&
+        !PieEnqueue(item, classIndex, flow->GetQueueDisc()->GetCurrentSize()))
+    {
+        return false;
     }
 
     if (flow->GetStatus() == LLQFlow::INACTIVE)
     {
         flow->SetStatus(LLQFlow::NEW_FLOW);
+        SetFlowActive(h, true);
         flow->SetDeficit(m_quantum);
-        m_newFlows.push_back(flow);
+        m_newFlows.push_back(PeekPointer(flow));
     }
 
     flow->GetQueueDisc()->Enqueue(item);
+    UpdateBacklog(classIndex, flow->GetQueueDisc()->GetNBytes());
 
-    NS_LOG_DEBUG("Packet enqueued into flow " << h << "; flow index " << m_flowsIndices[h]);
+    NS_LOG_DEBUG("Packet enqueued into flow " << h << "; flow index " << classIndex);
 
     if (GetCurrentSize() > GetMaxSize())
     {
@@ -342,49 +973,584 @@ LLQQueueDisc::DoEnqueue(Ptr<QueueDiscItem> item)
     return true;
 }
 
-Ptr<QueueDiscItem>
-LLQQueueDisc::DoDequeue()
+void
+LLQQueueDisc::ReclaimIdleFlows()
 {
     NS_LOG_FUNCTION(this);
 
-    Ptr<LLQFlow> flow;
-    Ptr<QueueDiscItem> item;
+    Time now = Simulator::Now();
 
-    do
+    while (!m_idleFlows.empty() && m_idleFlows.front().second + m_idleTimeout <= now)
     {
-        bool found = false;
+        uint32_t index = m_idleFlows.front().first;
+        Time since = m_idleFlows.front().second;
+        m_idleFlows.pop_front();
 
-        while (!found && !m_newFlows.empty())
-        {
-            flow = m_newFlows.front();
+        Ptr<LLQFlow> flow = StaticCast<LLQFlow>(GetQueueDiscClass(index));
+        uint32_t& classIndex = m_flowClass[flow->GetIndex()];
 
-            if (flow->GetDeficit() <= 0)
-            {
-                NS_LOG_DEBUG("Increase deficit for new flow index " << flow->GetIndex());
-                flow->IncreaseDeficit(m_quantum);
-                flow->SetStatus(LLQFlow::OLD_FLOW);
-                m_oldFlows.push_back(flow);
-                m_newFlows.pop_front();
-            }
-            else
-            {
-                NS_LOG_DEBUG("Found a new flow " << flow->GetIndex() << " with positive deficit");
-                found = true;
-            }
+        // skip the flow if it has been active since then or it has been reclaimed already
+        if (flow->GetStatus() != LLQFlow::INACTIVE || m_idleSince[index] != since ||
+            classIndex != index)
+        {
+            continue;
         }
 
-        while (!found && !m_oldFlows.empty())
-        {
-            flow = m_oldFlows.front();
+        NS_LOG_DEBUG("Reclaiming the idle flow queue of class " << index << " with index "
+                                                                << flow->GetIndex());
+        classIndex = NO_CLASS;
+        m_freeClasses.push_back(index);
+        m_liveFlows--;
+    }
+}
 
-            if (flow->GetDeficit() <= 0)
-            {
-                NS_LOG_DEBUG("Increase deficit for old flow index " << flow->GetIndex());
-                flow->IncreaseDeficit(m_quantum);
-                m_oldFlows.push_back(flow);
-                m_oldFlows.pop_front();
-            }
-            else
+bool
+LLQQueueDisc::PriorityEnqueue(Ptr<QueueDiscItem> item)
+{
+    NS_LOG_FUNCTION(this << item);
+
+    // add the tokens accumulated since the last packet
+    Time now = Simulator::Now();
+    m_priorityTokens =
+        std::min<double>(m_priorityBurst,
+                         m_priorityTokens + m_priorityRate.GetBitRate() / 8.0 *
+                                                (now - m_priorityLastRefill).GetSeconds());
+    m_priorityLastRefill = now;
+
+    if (m_priorityTokens < item->GetSize())
+    {
+        NS_LOG_DEBUG("Priority packet above the rate of the policer, drop it");
+        DropBeforeEnqueue(item, POLICED_DROP);
+        return false;
+    }
+
+    // the priority queue shares the limit of the queue disc with the flows
+    if (GetCurrentSize() + item > GetMaxSize())
+    {
+        NS_LOG_DEBUG("Queue disc limit exceeded, drop the priority packet");
+        DropBeforeEnqueue(item, LIMIT_EXCEEDED_DROP);
+        return false;
+    }
+
+    if (!m_priorityQueue->Enqueue(item))
+    {
+        return false;
+    }
+
+    m_priorityTokens -= item->GetSize();
+    NS_LOG_DEBUG("Packet enqueued into the priority queue");
+    return true;
+}
+
+bool
+LLQQueueDisc::L4sEnqueue(Ptr<QueueDiscItem> item)
+{
+    NS_LOG_FUNCTION(this << item);
+
+    // the L4S queue shares the limit of the queue disc with the classic traffic
+    if (GetCurrentSize() + item > GetMaxSize())
+    {
+        NS_LOG_DEBUG("Queue disc limit exceeded, drop the L4S packet");
+        DropBeforeEnqueue(item, LIMIT_EXCEEDED_DROP);
+        return false;
+    }
+
+    item->SetTimeStamp(Simulator::Now());
+
+    if (!m_l4sQueue->Enqueue(item))
+    {
+        return false;
+    }
+
+    NS_LOG_DEBUG("Packet enqueued into the L4S queue");
+    return true;
+}
+
+Ptr<QueueDiscItem>
+LLQQueueDisc::L4sDequeue()
+{
+    NS_LOG_FUNCTION(this);
+
+    Ptr<QueueDiscItem> item = m_l4sQueue->Dequeue();
+
+    if (Simulator::Now() - item->GetTimeStamp() > m_stepThreshold)
+    {
+        Mark(item, STEP_MARK);
+    }
+    else if (m_baseProb > 0 && m_uv->GetValue() < m_couplingFactor * m_baseProb)
+    {
+        Mark(item, COUPLED_MARK);
+    }
+
+    return item;
+}
+
+Time
+LLQQueueDisc::GetClassicHeadTime() const
+{
+    Time head = Simulator::Now();
+
+    if (m_useFlowPool)
+    {
+        // the queue of the pool holds the packets of all the flows in arrival order
+        if (!m_poolQueue->IsEmpty())
+        {
+            head = m_poolQueue->Peek()->GetTimeStamp();
+        }
+        return head;
+    }
+
+    // the oldest packet is at the head of an active flow
+    for (const LLQFlowList* list : {&m_newFlows, &m_oldFlows})
+    {
+        for (LLQFlow* flow = list->front(); flow != nullptr; flow = list->next(flow))
+        {
+            Ptr<const QueueDiscItem> item = flow->GetQueueDisc()->GetInternalQueue(0)->Peek();
+            if (item && item->GetTimeStamp() < head)
+            {
+                head = item->GetTimeStamp();
+            }
+        }
+    }
+    return head;
+}
+
+void
+LLQQueueDisc::DualUpdate()
+{
+    NS_LOG_FUNCTION(this);
+
+    // the queue delay of the classic traffic is the sojourn time of its oldest packet
+    double delay = (Simulator::Now() - GetClassicHeadTime()).GetSeconds();
+
+    // PI controller with the gains scaled to the update period (Section 2.4 of RFC 9332)
+    double tUpdate = m_tUpdate.GetSeconds();
+    double p = m_baseProb + m_dualAlpha * tUpdate * (delay - m_dualTarget.GetSeconds()) +
+               m_dualBeta * tUpdate * (delay - m_classicDelayOld);
+    m_baseProb = std::min(std::max(p, 0.), 1.);
+    m_classicDelayOld = delay;
+
+    NS_LOG_DEBUG("Classic queue delay " << delay << " base probability " << m_baseProb);
+
+    m_dualUpdateEvent = Simulator::Schedule(m_tUpdate, &LLQQueueDisc::DualUpdate, this);
+}
+
+bool
+LLQQueueDisc::PieEnqueue(Ptr<QueueDiscItem> item, uint32_t index, QueueSize qSize)
+{
+    NS_LOG_FUNCTION(this << item << index << qSize);
+
+    uint32_t pos = m_pieSlot[index];
+    if (pos == NO_CLASS)
+    {
+        // allocate the state of the flow at the end of the state arrays
+        pos = m_pieCount++;
+        m_pieSlot[index] = pos;
+        m_pieFlow[pos] = index;
+        m_pieDropProb[pos] = 0;
+        m_pieQDelay[pos] = 0;
+        m_pieQDelayOld[pos] = 0;
+        m_pieBurst[pos] = m_maxBurst.GetSeconds();
+        m_pieAccuProb[pos] = 0;
+    }
+
+    uint8_t tosByte = 0;
+    if (m_useL4s && item->GetUint8Value(QueueItem::IP_DSFIELD, tosByte) &&
+        ((tosByte & 0x3) == 1 || (tosByte & 0x3) == 3))
+    {
+        NS_LOG_DEBUG("L4S packet, marked at dequeue if above the CE threshold");
+        return true;
+    }
+
+    double dropProb = m_pieDropProb[pos];
+
+    if (m_pieBurst[pos] > 0)
+    {
+        return true;
+    }
+
+    // Safeguard PIE to be work conserving (Section 4.1 of RFC 8033)
+    if ((m_pieQDelayOld[pos] < 0.5 * m_qDelayRef.GetSeconds() && dropProb < 0.2) ||
+        qSize.GetValue() <= (qSize.GetUnit() == QueueSizeUnit::BYTES ? 2 * m_meanPktSize : 2))
+    {
+        return true;
+    }
+
+    double p = dropProb;
+    if (qSize.GetUnit() == QueueSizeUnit::BYTES)
+    {
+        p = p * item->GetSize() / m_meanPktSize;
+    }
+
+    if (m_useDerandomization)
+    {
+        if (dropProb == 0)
+        {
+            m_pieAccuProb[pos] = 0;
+        }
+        m_pieAccuProb[pos] += dropProb;
+        if (m_pieAccuProb[pos] < 0.85)
+        {
+            return true;
+        }
+        if (m_pieAccuProb[pos] < 8.5 && m_uv->GetValue() > p)
+        {
+            return true;
+        }
+    }
+    else if (m_uv->GetValue() > p)
+    {
+        return true;
+    }
+
+    m_pieAccuProb[pos] = 0;
+
+    if (!m_useEcn || dropProb > m_markEcnTh || !Mark(item, UNFORCED_MARK))
+    {
+        NS_LOG_DEBUG("Early drop of a packet of flow " << index);
+        DropBeforeEnqueue(item, UNFORCED_DROP);
+        return false;
+    }
+
+    return true;
+}
+
+void
+LLQQueueDisc::PieDequeue(Ptr<QueueDiscItem> item, uint32_t index, bool empty)
+{
+    NS_LOG_FUNCTION(this << item << index << empty);
+
+    Time sojourn = Simulator::Now() - item->GetTimeStamp();
+
+    // the state of a flow is only released when the flow is empty
+    m_pieQDelay[m_pieSlot[index]] = (empty ? 0 : sojourn.GetSeconds());
+
+    MarkAboveCeThreshold(item);
+}
+
+void
+LLQQueueDisc::MarkAboveCeThreshold(Ptr<QueueDiscItem> item)
+{
+    NS_LOG_FUNCTION(this << item);
+
+    uint8_t tosByte = 0;
+    if (m_useL4s && Simulator::Now() - item->GetTimeStamp() > m_ceThreshold &&
+        item->GetUint8Value(QueueItem::IP_DSFIELD, tosByte) &&
+        ((tosByte & 0x3) == 1 || (tosByte & 0x3) == 3))
+    {
+        Mark(item, CE_THRESHOLD_EXCEEDED_MARK);
+    }
+}
+
+Ptr<QueueDiscItem>
+LLQQueueDisc::FlowDequeue(uint32_t index)
+{
+    NS_LOG_FUNCTION(this << index);
+
+    if (m_useFlowPool)
+    {
+        return PopPacket(index);
+    }
+    return GetQueueDiscClass(index)->GetQueueDisc()->Dequeue();
+}
+
+bool
+LLQQueueDisc::CoDelOkToDrop(Ptr<QueueDiscItem> item, uint32_t index, Time now)
+{
+    NS_LOG_FUNCTION(this << item << index << now);
+
+    CoDelState& state = m_codel[index];
+    Time sojourn = now - item->GetTimeStamp();
+    uint32_t bytes = (m_useFlowPool ? m_poolBytes[index]
+                                    : GetQueueDiscClass(index)->GetQueueDisc()->GetNBytes());
+
+    // do not drop while the sojourn time is below target or less than a
+    // quantum is left in the queue of the flow
+    if (sojourn < m_codelTarget || bytes <= m_quantum)
+    {
+        state.firstAboveTime = Time(0);
+        return false;
+    }
+
+    if (state.firstAboveTime.IsZero())
+    {
+        state.firstAboveTime = now + m_codelInterval;
+        return false;
+    }
+
+    return now >= state.firstAboveTime;
+}
+
+Ptr<QueueDiscItem>
+LLQQueueDisc::CoDelDequeue(uint32_t index)
+{
+    NS_LOG_FUNCTION(this << index);
+
+    CoDelState& state = m_codel[index];
+    Time now = Simulator::Now();
+
+    // next drop or mark time after count drops or marks since time t
+    auto controlLaw = [this](Time t, uint32_t count) {
+        return t + Seconds(m_codelInterval.GetSeconds() / std::sqrt(count));
+    };
+
+    Ptr<QueueDiscItem> item = FlowDequeue(index);
+
+    if (!item)
+    {
+        state.dropping = false;
+        return nullptr;
+    }
+
+    bool okToDrop = CoDelOkToDrop(item, index, now);
+
+    if (state.dropping)
+    {
+        if (!okToDrop)
+        {
+            NS_LOG_DEBUG("Sojourn time below target, leave the dropping state");
+            state.dropping = false;
+        }
+
+        while (state.dropping && now >= state.dropNext)
+        {
+            state.count++;
+            state.dropNext = controlLaw(state.dropNext, state.count);
+
+            if (m_useEcn && Mark(item, TARGET_EXCEEDED_MARK))
+            {
+                break;
+            }
+
+            DropAfterDequeue(item, TARGET_EXCEEDED_DROP);
+            item = FlowDequeue(index);
+
+            if (!item || !CoDelOkToDrop(item, index, now))
+            {
+                state.dropping = false;
+            }
+        }
+    }
+    else if (okToDrop)
+    {
+        NS_LOG_DEBUG("Sojourn time above target for an interval, enter the dropping state");
+
+        if (!m_useEcn || !Mark(item, TARGET_EXCEEDED_MARK))
+        {
+            DropAfterDequeue(item, TARGET_EXCEEDED_DROP);
+            item = FlowDequeue(index);
+
+            if (item)
+            {
+                CoDelOkToDrop(item, index, now);
+            }
+        }
+
+        state.dropping = true;
+
+        // restart from the previous drop rate if the dropping state was left recently
+        uint32_t delta = state.count - state.lastCount;
+        state.count = (delta > 1 && now - state.dropNext < m_codelInterval * 16 ? delta : 1);
+        state.lastCount = state.count;
+        state.dropNext = controlLaw(now, state.count);
+    }
+
+    if (item)
+    {
+        MarkAboveCeThreshold(item);
+    }
+
+    return item;
+}
+
+void
+LLQQueueDisc::PieUpdate()
+{
+    NS_LOG_FUNCTION(this);
+
+    const double a = m_a;
+    const double b = m_b;
+    const double qDelayRef = m_qDelayRef.GetSeconds();
+    const double tUpdate = m_tUpdate.GetSeconds();
+    const double maxBurst = m_maxBurst.GetSeconds();
+    const bool capDropAdjustment = m_isCapDropAdjustment;
+    double* dropProb = m_pieDropProb.data();
+    double* qDelay = m_pieQDelay.data();
+    double* qDelayOld = m_pieQDelayOld.data();
+    double* burst = m_pieBurst.data();
+
+    // update the drop probabilities (Section 4.2 of RFC 8033) with selects
+    // instead of branches, so that the loop can be vectorized
+    for (uint32_t i = 0; i < m_pieCount; i++)
+    {
+        double prob = dropProb[i];
+        double p = a * (qDelay[i] - qDelayRef) + b * (qDelay[i] - qDelayOld[i]);
+
+        // scale the adjustment to the drop probability
+        p *= (prob < 0.000001 ? 1. / 2048
+              : prob < 0.00001 ? 1. / 512
+              : prob < 0.0001  ? 1. / 128
+              : prob < 0.001   ? 1. / 32
+              : prob < 0.01    ? 1. / 8
+              : prob < 0.1     ? 1. / 2
+                               : 1.);
+        p = (capDropAdjustment && prob >= 0.1 && p > 0.02 ? 0.02 : p);
+        p += prob;
+
+        // decay the drop probability when the queue is empty, raise it on high delay
+        p = (qDelay[i] == 0 && qDelayOld[i] == 0 ? p * 0.98 : qDelay[i] > 0.25 ? p + 0.02 : p);
+        dropProb[i] = std::min(std::max(p, 0.), 1.);
+
+        burst[i] = std::max(burst[i] - tUpdate, 0.);
+        burst[i] = (burst[i] == 0 && dropProb[i] == 0 && qDelay[i] < 0.5 * qDelayRef &&
+                            qDelayOld[i] < 0.5 * qDelayRef
+                        ? maxBurst
+                        : burst[i]);
+        qDelayOld[i] = qDelay[i];
+    }
+
+    // release the state of the empty flows whose drop probability has decayed,
+    // by moving the state of the last flow in its place
+    for (uint32_t i = 0; i < m_pieCount;)
+    {
+        uint32_t index = m_pieFlow[i];
+
+        if (dropProb[i] > 0 || qDelayOld[i] > 0 || m_backlog[index] > 0)
+        {
+            i++;
+            continue;
+        }
+
+        PieRelease(i);
+    }
+
+    m_pieUpdateEvent = Simulator::Schedule(m_tUpdate, &LLQQueueDisc::PieUpdate, this);
+}
+
+void
+LLQQueueDisc::PieRelease(uint32_t pos)
+{
+    NS_LOG_FUNCTION(this << pos);
+
+    m_pieSlot[m_pieFlow[pos]] = NO_CLASS;
+    uint32_t last = --m_pieCount;
+
+    if (pos != last)
+    {
+        m_pieFlow[pos] = m_pieFlow[last];
+        m_pieSlot[m_pieFlow[pos]] = pos;
+        m_pieDropProb[pos] = m_pieDropProb[last];
+        m_pieQDelay[pos] = m_pieQDelay[last];
+        m_pieQDelayOld[pos] = m_pieQDelayOld[last];
+        m_pieBurst[pos] = m_pieBurst[last];
+        m_pieAccuProb[pos] = m_pieAccuProb[last];
+    }
+}
+
+bool
+LLQQueueDisc::PoolEnqueue(Ptr<QueueDiscItem> item, uint32_t index)
+{
+    NS_LOG_FUNCTION(this << item << index);
+
+    QueueSizeUnit unit = GetMaxSize().GetUnit();
+    QueueSize size(unit,
+                   (unit == QueueSizeUnit::PACKETS ? m_poolPackets[index] : m_poolBytes[index]));
+
+    if (m_flowAqm == SHARED_PIE && !PieEnqueue(item, index, size))
+    {
+        return false;
+    }
+
+    if (!PushPacket(item, index))
+    {
+        NS_LOG_DEBUG("Packet rejected by the queue of the flow pool");
+        return false;
+    }
+
+    if (m_poolStatus[index] == LLQFlow::INACTIVE)
+    {
+        m_poolStatus[index] = LLQFlow::NEW_FLOW;
+        SetFlowActive(index, true);
+        m_poolDeficit[index] = m_quantum;
+        PushFlow(m_newPool, index);
+    }
+
+    UpdateBacklog(index, m_poolBytes[index]);
+
+    NS_LOG_DEBUG("Packet enqueued into pool flow " << index);
+
+    if (GetCurrentSize() > GetMaxSize())
+    {
+        NS_LOG_DEBUG("Overload; enter LLQDrop ()");
+        LLQDrop();
+    }
+
+    return true;
+}
+
+Ptr<QueueDiscItem>
+LLQQueueDisc::DoDequeue()
+{
+    NS_LOG_FUNCTION(this);
+
+    if (m_priorityQueue && !m_priorityQueue->IsEmpty())
+    {
+        NS_LOG_DEBUG("Dequeue from the priority queue");
+        return m_priorityQueue->Dequeue();
+    }
+
+    // time-shifted FIFO between the L4S queue and the classic traffic
+    if (m_l4sQueue && !m_l4sQueue->IsEmpty() &&
+        Simulator::Now() - m_l4sQueue->Peek()->GetTimeStamp() + m_timeShift >=
+            Simulator::Now() - GetClassicHeadTime())
+    {
+        NS_LOG_DEBUG("Dequeue from the L4S queue");
+        return L4sDequeue();
+    }
+
+    if (m_useFlowPool)
+    {
+        return PoolDequeue();
+    }
+
+    LLQFlow* flow = nullptr;
+    Ptr<QueueDiscItem> item;
+
+    do
+    {
+        bool found = false;
+
+        while (!found && !m_newFlows.empty())
+        {
+            flow = m_newFlows.front();
+
+            if (flow->GetDeficit() <= 0)
+            {
+                NS_LOG_DEBUG("Increase deficit for new flow index " << flow->GetIndex());
+                flow->IncreaseDeficit(m_quantum);
+                flow->SetStatus(LLQFlow::OLD_FLOW);
+                m_newFlows.pop_front();
+                m_oldFlows.push_back(flow);
+            }
+            else
+            {
+                NS_LOG_DEBUG("Found a new flow " << flow->GetIndex() << " with positive deficit");
+                found = true;
+            }
+        }
+
+        while (!found && !m_oldFlows.empty())
+        {
+            flow = m_oldFlows.front();
+
+            if (flow->GetDeficit() <= 0)
+            {
+                NS_LOG_DEBUG("Increase deficit for old flow index " << flow->GetIndex());
+                flow->IncreaseDeficit(m_quantum);
+                m_oldFlows.pop_front();
+                m_oldFlows.push_back(flow);
+            }
+            else
             {
                 NS_LOG_DEBUG("Found an old flow " << flow->GetIndex() << " with positive deficit");
                 found = true;
@@ -397,7 +1563,9 @@ LLQQueueDisc::DoDequeue()
             return nullptr;
         }
 
-        item = flow->GetQueueDisc()->Dequeue();
+        uint32_t index = m_flowClass[flow->GetIndex()];
+        item = (m_flowAqm == CODEL ? CoDelDequeue(index) : flow->GetQueueDisc()->Dequeue());
+        UpdateBacklog(index, flow->GetQueueDisc()->GetNBytes());
 
         if (!item)
         {
@@ -405,18 +1573,30 @@ LLQQueueDisc::DoDequeue()
             if (!m_newFlows.empty())
             {
                 flow->SetStatus(LLQFlow::OLD_FLOW);
-                m_oldFlows.push_back(flow);
                 m_newFlows.pop_front();
+                m_oldFlows.push_back(flow);
             }
             else
             {
                 flow->SetStatus(LLQFlow::INACTIVE);
+                SetFlowActive(flow->GetIndex(), false);
                 m_oldFlows.pop_front();
+
+                if (m_idleTimeout.IsStrictlyPositive())
+                {
+                    m_idleSince[index] = Simulator::Now();
+                    m_idleFlows.emplace_back(index, m_idleSince[index]);
+                }
             }
         }
         else
         {
             NS_LOG_DEBUG("Dequeued packet " << item->GetPacket());
+
+            if (m_flowAqm == SHARED_PIE)
+            {
+                PieDequeue(item, index, m_backlog[index] == 0);
+            }
         }
     } while (!item);
 
@@ -425,6 +1605,183 @@ LLQQueueDisc::DoDequeue()
     return item;
 }
 
+Ptr<QueueDiscItem>
+LLQQueueDisc::PoolDequeue()
+{
+    NS_LOG_FUNCTION(this);
+
+    uint32_t index = NO_CLASS;
+    Ptr<QueueDiscItem> item;
+
+    do
+    {
+        bool found = false;
+
+        while (!found && m_newPool.head != NO_CLASS)
+        {
+            index = m_newPool.head;
+
+            if (m_poolDeficit[index] <= 0)
+            {
+                NS_LOG_DEBUG("Increase deficit for new pool flow " << index);
+                m_poolDeficit[index] += m_quantum;
+                m_poolStatus[index] = LLQFlow::OLD_FLOW;
+                PopFlow(m_newPool);
+                PushFlow(m_oldPool, index);
+            }
+            else
+            {
+                NS_LOG_DEBUG("Found a new pool flow " << index << " with positive deficit");
+                found = true;
+            }
+        }
+
+        while (!found && m_oldPool.head != NO_CLASS)
+        {
+            index = m_oldPool.head;
+
+            if (m_poolDeficit[index] <= 0)
+            {
+                NS_LOG_DEBUG("Increase deficit for old pool flow " << index);
+                m_poolDeficit[index] += m_quantum;
+                PopFlow(m_oldPool);
+                PushFlow(m_oldPool, index);
+            }
+            else
+            {
+                NS_LOG_DEBUG("Found an old pool flow " << index << " with positive deficit");
+                found = true;
+            }
+        }
+
+        if (!found)
+        {
+            NS_LOG_DEBUG("No flow found to dequeue a packet");
+            return nullptr;
+        }
+
+        item = (m_flowAqm == CODEL ? CoDelDequeue(index) : PopPacket(index));
+        UpdateBacklog(index, m_poolBytes[index]);
+
+        if (!item)
+        {
+            NS_LOG_DEBUG("Could not get a packet from the selected pool flow");
+            if (m_newPool.head != NO_CLASS)
+            {
+                m_poolStatus[index] = LLQFlow::OLD_FLOW;
+                PopFlow(m_newPool);
+                PushFlow(m_oldPool, index);
+            }
+            else
+            {
+                m_poolStatus[index] = LLQFlow::INACTIVE;
+                SetFlowActive(index, false);
+                PopFlow(m_oldPool);
+            }
+        }
+        else
+        {
+            NS_LOG_DEBUG("Dequeued packet " << item->GetPacket());
+
+            if (m_flowAqm == SHARED_PIE)
+            {
+                PieDequeue(item, index, m_backlog[index] == 0);
+            }
+        }
+    } while (!item);
+
+    m_poolDeficit[index] -= item->GetSize();
+
+    return item;
+}
+
+bool
+LLQQueueDisc::PushPacket(Ptr<QueueDiscItem> item, uint32_t index)
+{
+    LLQPoolQueue::ConstIterator pos;
+
+    if (!m_poolQueue->Enqueue(item, pos))
+    {
+        return false;
+    }
+
+    uint32_t slot = m_slabFree;
+    if (slot == NO_CLASS)
+    {
+        slot = m_slabPos.size();
+        m_slabPos.push_back(pos);
+        m_slabNext.push_back(NO_CLASS);
+    }
+    else
+    {
+        m_slabFree = m_slabNext[slot];
+        m_slabPos[slot] = pos;
+        m_slabNext[slot] = NO_CLASS;
+    }
+
+    if (m_poolTail[index] != NO_CLASS)
+    {
+        m_slabNext[m_poolTail[index]] = slot;
+    }
+    else
+    {
+        m_poolHead[index] = slot;
+    }
+    m_poolTail[index] = slot;
+    m_poolPackets[index]++;
+    m_poolBytes[index] += item->GetSize();
+    return true;
+}
+
+Ptr<QueueDiscItem>
+LLQQueueDisc::PopPacket(uint32_t index)
+{
+    uint32_t slot = m_poolHead[index];
+
+    if (slot == NO_CLASS)
+    {
+        return nullptr;
+    }
+
+    m_poolHead[index] = m_slabNext[slot];
+    if (m_poolHead[index] == NO_CLASS)
+    {
+        m_poolTail[index] = NO_CLASS;
+    }
+    m_slabNext[slot] = m_slabFree;
+    m_slabFree = slot;
+
+    Ptr<QueueDiscItem> item = m_poolQueue->Dequeue(m_slabPos[slot]);
+    m_poolPackets[index]--;
+    m_poolBytes[index] -= item->GetSize();
+    return item;
+}
+
+void
+LLQQueueDisc::PushFlow(FlowIdList& list, uint32_t index)
+{
+    m_poolNext[index] = NO_CLASS;
+    if (list.tail != NO_CLASS)
+    {
+        m_poolNext[list.tail] = index;
+    }
+    else
+    {
+        list.head = index;
+    }
+    list.tail = index;
+}
+
+void
+LLQQueueDisc::PopFlow(FlowIdList& list)
+{
+    list.head = m_poolNext[list.head];
+    if (list.head == NO_CLASS)
+    {
+        list.tail = NO_CLASS;
+    }
+}
+
 bool
 LLQQueueDisc::CheckConfig()
 {
@@ -435,9 +1792,58 @@ LLQQueueDisc::CheckConfig()
         return false;
     }
 
-    if (GetNInternalQueues() > 0)
+    if (m_idleTimeout.IsStrictlyPositive() && m_flowAqm == CHILD_PIE)
+    {
+        NS_LOG_ERROR("The state of a child PIE queue disc cannot be reset for a new flow, set "
+                     "FlowAqm to SharedPie, CoDel or None to reclaim idle flows");
+        return false;
+    }
+
+    if (m_useDualQueue && m_flowAqm != NONE)
+    {
+        NS_LOG_ERROR("The classic traffic of the dual queue is managed by the coupled AQM, "
+                     "set FlowAqm to None");
+        return false;
+    }
+
+    if (m_useFlowPool && m_flowAqm == CHILD_PIE)
+    {
+        NS_LOG_ERROR("The flows of the pool have no child queue disc, set FlowAqm to "
+                     "SharedPie, CoDel or None");
+        return false;
+    }
+
+    // the priority queue, followed by the L4S queue (the queue of the flow pool is
+    // added when the pool is allocated)
+    uint32_t nQueues = (m_usePriorityQueue ? 1 : 0) + (m_useDualQueue ? 1 : 0);
+
+    if (nQueues > 0 && GetNInternalQueues() == 0)
+    {
+        // add the DropTail queues
+        for (uint32_t i = 0; i < nQueues; i++)
+        {
+            AddInternalQueue(CreateObjectWithAttributes<DropTailQueue<QueueDiscItem>>(
+                "MaxSize",
+                QueueSizeValue(GetMaxSize())));
+        }
+    }
+
+    if (GetNInternalQueues() != nQueues)
+    {
+        NS_LOG_ERROR("LLQQueueDisc needs "
+                     << nQueues
+                     << " internal queues (one for the priority queue and one for the L4S "
+                        "queue)");
+        return false;
+    }
+
+    uint32_t next = 0;
+    m_priorityQueue = (m_usePriorityQueue ? GetInternalQueue(next++) : nullptr);
+    m_l4sQueue = (m_useDualQueue ? GetInternalQueue(next++) : nullptr);
+
+    if (m_usePriorityQueue && (m_priorityRate.GetBitRate() == 0 || m_priorityBurst == 0))
     {
-        NS_LOG_ERROR("LLQQueueDisc cannot have internal queues");
+        NS_LOG_ERROR("The policer of the priority queue needs a positive rate and burst");
         return false;
     }
     // we are at initialization time. If the user has not set a quantum value,
@@ -461,6 +1867,13 @@ LLQQueueDisc::CheckConfig()
         }
     }
 
+    if (m_enableSetAssociativeHash && (m_setWays == 0 || m_setWays > 64))
+    {
+        NS_LOG_ERROR("The size of the set of queues used by set associative hash must be "
+                     "between 1 and 64");
+        return false;
+    }
+
     if (m_enableSetAssociativeHash && (m_flows % m_setWays != 0))
     {
         NS_LOG_ERROR("The number of queues must be an integer multiple of the size "
@@ -487,6 +1900,95 @@ LLQQueueDisc::InitializeParams()
 
     m_flowFactory.SetTypeId("ns3::LLQFlow");
 
+    m_flowClass.assign(m_flows, NO_CLASS);
+    m_flowTags.assign(m_flows, 0);
+    m_activeWays.assign(m_enableSetAssociativeHash ? m_flows / m_setWays : 0, 0);
+    m_backlog.clear();
+    m_backlog.reserve(m_flows);
+    m_backlogHeap.clear();
+    m_backlogHeap.reserve(m_flows);
+    m_backlogPos.clear();
+    m_backlogPos.reserve(m_flows);
+    m_idleFlows.clear();
+    m_idleSince.clear();
+    m_freeClasses.clear();
+    m_liveFlows = 0;
+    m_priorityTokens = m_priorityBurst;
+    m_priorityLastRefill = Simulator::Now();
+
+    if (m_useDualQueue)
+    {
+        m_baseProb = 0;
+        m_classicDelayOld = 0;
+        m_dualUpdateEvent = Simulator::Schedule(m_sUpdate, &LLQQueueDisc::DualUpdate, this);
+    }
+
+    if (m_flowAqm == SHARED_PIE)
+    {
+        m_pieCount = 0;
+        m_pieSlot.assign(m_flows, NO_CLASS);
+        m_pieFlow.assign(m_flows, 0);
+        m_pieDropProb.assign(m_flows, 0);
+        m_pieQDelay.assign(m_flows, 0);
+        m_pieQDelayOld.assign(m_flows, 0);
+        m_pieBurst.assign(m_flows, 0);
+        m_pieAccuProb.assign(m_flows, 0);
+        m_pieUpdateEvent = Simulator::Schedule(m_sUpdate, &LLQQueueDisc::PieUpdate, this);
+    }
+    else if (m_flowAqm == CODEL)
+    {
+        m_codel.assign(m_flows, CoDelState{Time(0), Time(0), 0, 0, false});
+    }
+
+    if (m_useFlowPool)
+    {
+        m_poolDeficit.assign(m_flows, 0);
+        m_poolStatus.assign(m_flows, LLQFlow::INACTIVE);
+        m_poolNext.assign(m_flows, NO_CLASS);
+        m_poolHead.assign(m_flows, NO_CLASS);
+        m_poolTail.assign(m_flows, NO_CLASS);
+        m_poolPackets.assign(m_flows, 0);
+        m_poolBytes.assign(m_flows, 0);
+        m_newPool = m_oldPool = FlowIdList{NO_CLASS, NO_CLASS};
+
+        // the queue disc enforces its limit by dropping from the fattest flow, hence the
+        // queue of the pool accepts every packet. The slab is sized for a full queue disc
+        // when the limit is in packets, and grows as needed
+        QueueSizeUnit unit = GetMaxSize().GetUnit();
+        m_poolQueue = CreateObjectWithAttributes<LLQPoolQueue>(
+            "MaxSize",
+            QueueSizeValue(QueueSize(unit, std::numeric_limits<uint32_t>::max())));
+        AddInternalQueue(m_poolQueue);
+
+        uint32_t slots =
+            (unit == QueueSizeUnit::PACKETS ? std::max(m_flows, GetMaxSize().GetValue()) : m_flows);
+        m_slabPos.assign(slots, LLQPoolQueue::ConstIterator());
+        m_slabNext.resize(slots);
+        for (uint32_t i = 0; i < slots; i++)
+        {
+            m_slabNext[i] = (i + 1 < slots ? i + 1 : NO_CLASS);
+        }
+        m_slabFree = 0;
+
+        // the flow of each bucket is the flow with the same index, and all of
+        // them are in the heap of the flow backlogs
+        for (uint32_t i = 0; i < m_flows; i++)
+        {
+            m_flowClass[i] = i;
+            UpdateBacklog(i, 0);
+        }
+        m_liveFlows = m_flows;
+        return;
+    }
+
+    if (m_flowAqm != CHILD_PIE)
+    {
+        // the flows only need to queue packets
+        m_queueDiscFactory.SetTypeId("ns3::FifoQueueDisc");
+        m_queueDiscFactory.Set("MaxSize", QueueSizeValue(GetMaxSize()));
+        return;
+    }
+
     m_queueDiscFactory.SetTypeId("ns3::PieQueueDisc");
     m_queueDiscFactory.Set("MaxSize", QueueSizeValue(GetMaxSize()));
     m_queueDiscFactory.Set("MeanPktSize", UintegerValue(m_meanPktSize));
@@ -507,38 +2009,35 @@ LLQQueueDisc::LLQDrop()
 {
     NS_LOG_FUNCTION(this);
 
-    uint32_t maxBacklog = 0;
-    uint32_t index = 0;
-    Ptr<QueueDisc> qd;
-
     /* Queue is full! Find the fat flow and drop packet(s) from it */
-    for (uint32_t i = 0; i < GetNQueueDiscClasses(); i++)
+    uint32_t index = m_backlogHeap.front();
+    uint32_t maxBacklog = m_backlog[index];
+    if (maxBacklog == 0)
     {
-        qd = GetQueueDiscClass(i)->GetQueueDisc();
-        uint32_t bytes = qd->GetNBytes();
-        if (bytes > maxBacklog)
-        {
-            maxBacklog = bytes;
-            index = i;
-        }
+        // the packets over the limit are in the priority or L4S queue
+        NS_LOG_DEBUG("All the flows are empty, nothing to drop");
+        return index;
     }
 
     /* Our goal is to drop half of this fat flow backlog */
     uint32_t len = 0;
     uint32_t count = 0;
     uint32_t threshold = maxBacklog >> 1;
-    qd = GetQueueDiscClass(index)->GetQueueDisc();
+    Ptr<Queue<QueueDiscItem>> queue =
+        (m_useFlowPool ? nullptr : GetQueueDiscClass(index)->GetQueueDisc()->GetInternalQueue(0));
     Ptr<QueueDiscItem> item;
 
     do
     {
         NS_LOG_DEBUG("Drop packet (overflow); count: " << count << " len: " << len
                                                        << " threshold: " << threshold);
-        item = qd->GetInternalQueue(0)->Dequeue();
+        item = (m_useFlowPool ? PopPacket(index) : queue->Dequeue());
         DropAfterDequeue(item, OVERLIMIT_DROP);
         len += item->GetSize();
     } while (++count < m_dropBatchSize && len < threshold);
 
+    UpdateBacklog(index, (m_useFlowPool ? m_poolBytes[index] : queue->GetNBytes()));
+
     return index;
 }
 
@@ -3,10 +3,17 @@
 
 #include "queue-disc.h"
 
+#include "ns3/data-rate.h"
+#include "ns3/event-id.h"
+#include "ns3/nstime.h"
 #include "ns3/object-factory.h"
+#include "ns3/queue.h"
+#include "ns3/random-variable-stream.h"
+#include "ns3/traced-value.h"
 
-#include <list>
-#include <map>
+#include <deque>
+#include <utility>
+#include <vector>
 
 namespace ns3
 {
@@ -80,9 +87,144 @@ class LLQFlow : public QueueDiscClass
     uint32_t GetIndex() const;
 
   private:
+    friend class LLQFlowList;
+
     int32_t m_deficit;   //!< the deficit for this flow
     FlowStatus m_status; //!< the status of this flow
     uint32_t m_index;    //!< the index for this flow
+    LLQFlow* m_next;     //!< the next flow in the list of new or old flows
+};
+
+/**
+ * \ingroup traffic-control
+ *
+ * \brief An intrusive FIFO list of flows, linked through the flows themselves,
+ * so that moving a flow between lists allocates nothing. A flow can be in one
+ * list at a time. The list does not own the flows, which are kept alive by the
+ * queue disc they are a class of.
+ */
+
+class LLQFlowList
+{
+  public:
+    /**
+     * \brief Check whether the list is empty
+     * \return true if the list is empty
+     */
+    bool empty() const
+    {
+        return m_head == nullptr;
+    }
+
+    /**
+     * \brief Get the first flow of the list
+     * \return the first flow of the list
+     */
+    LLQFlow* front() const
+    {
+        return m_head;
+    }
+
+    /**
+     * \brief Get the flow following a flow of the list
+     * \param flow a flow of the list
+     * \return the next flow, or nullptr if the flow is the last one
+     */
+    LLQFlow* next(const LLQFlow* flow) const
+    {
+        return flow->m_next;
+    }
+
+    /**
+     * \brief Append a flow to the list. The flow must not be in a list, hence
+     * the first flow of a list is popped before being appended to a list.
+     * \param flow the flow
+     */
+    void push_back(LLQFlow* flow)
+    {
+        flow->m_next = nullptr;
+        if (m_tail)
+        {
+            m_tail->m_next = flow;
+        }
+        else
+        {
+            m_head = flow;
+        }
+        m_tail = flow;
+    }
+
+    /**
+     * \brief Remove the first flow of the list
+     */
+    void pop_front()
+    {
+        m_head = m_head->m_next;
+        if (!m_head)
+        {
+            m_tail = nullptr;
+        }
+    }
+
+    /**
+     * \brief Remove all the flows from the list
+     */
+    void clear()
+    {
+        m_head = m_tail = nullptr;
+    }
+
+  private:
+    LLQFlow* m_head{nullptr}; //!< the first flow of the list
+    LLQFlow* m_tail{nullptr}; //!< the last flow of the list
+};
+
+/**
+ * \ingroup traffic-control
+ *
+ * \brief The internal queue storing the packets of all the flows of the flow
+ * pool of a LLQ queue disc, in arrival order. The queue disc links the packets
+ * of each flow through their positions and dequeues them by position, so that
+ * the pool needs a single queue while the packets are still counted by the
+ * queue disc.
+ */
+
+class LLQPoolQueue : public Queue<QueueDiscItem>
+{
+  public:
+    /**
+     * \brief Get the type ID.
+     * \return the object TypeId
+     */
+    static TypeId GetTypeId();
+    /**
+     * \brief LLQPoolQueue constructor
+     */
+    LLQPoolQueue();
+
+    ~LLQPoolQueue() override;
+
+    /// Position of a packet in the queue, valid until the packet is dequeued
+    using ConstIterator = Queue<QueueDiscItem>::ConstIterator;
+
+    bool Enqueue(Ptr<QueueDiscItem> item) override;
+    Ptr<QueueDiscItem> Dequeue() override;
+    Ptr<QueueDiscItem> Remove() override;
+    Ptr<const QueueDiscItem> Peek() const override;
+
+    /**
+     * \brief Enqueue a packet at the tail of the queue
+     * \param item the packet
+     * \param pos the position of the packet, if enqueued
+     * \return true if the packet was enqueued
+     */
+    bool Enqueue(Ptr<QueueDiscItem> item, ConstIterator& pos);
+    /**
+     * \brief Dequeue the packet at a given position
+     * \param pos the position of the packet
+     * \return the packet
+     */
+    Ptr<QueueDiscItem> Dequeue(ConstIterator pos);
 };
 
 /**
@@ -106,6 +248,27 @@ class LLQQueueDisc : public QueueDisc
 
     ~LLQQueueDisc() override;
 
+    /**
+     * \brief Active queue management applied to each flow
+     */
+    enum FlowAqmType
+    {
+        CHILD_PIE,  //!< A PIE queue disc per flow, each with its own update timer
+        SHARED_PIE, //!< PIE state per flow, updated by a single timer of this queue disc
+        CODEL,      //!< CoDel state per flow, driven by the sojourn times at dequeue (no timer)
+        NONE,       //!< No AQM per flow (required by the dual queue, whose AQM manages the flows)
+    };
+
+    /**
+     * \brief Hash function used to classify packets into flows
+     */
+    enum HashFunctionType
+    {
+        DEFAULT_HASH, //!< The hash of the queue disc item, over its serialized 5-tuple
+        CRC32C,       //!< CRC32C over the parsed 5-tuple, with the crc32 instruction if available
+        MIX64,        //!< 64-bit multiply-xorshift mix over the parsed 5-tuple
+    };
+
     /**
      * \brief Set the quantum value.
      *
@@ -122,10 +285,77 @@ class LLQQueueDisc : public QueueDisc
      */
     uint32_t GetQuantum() const;
 
+    /**
+     * \brief Get the number of live flows, i.e., of the flows whose state is
+     * allocated and attached to a bucket. Flows that have been inactive for longer
+     * than the idle timeout are reclaimed and no longer live.
+     *
+     * \returns The number of live flows
+     */
+    uint32_t GetNLiveFlows() const;
+
+    /**
+     * \brief Check whether the Crc32c hash function runs the SSE4.2 crc32
+     * instruction, which is used whenever the CPU has it, or the portable
+     * table-driven (slicing-by-8) implementation.
+     *
+     * \returns true if the crc32 instruction is used
+     */
+    static bool IsCrc32cHardwareAccelerated();
+
+    /**
+     * Assign a fixed random variable stream number to the random variables
+     * used by this model.  Return the number of streams (possibly zero) that
+     * have been assigned.
+     *
+     * \param stream first stream index to use
+     * \return the number of stream indices assigned by this model
+     */
+    int64_t AssignStreams(int64_t stream);
+
+    /**
+     * Set whether packets with the specified DSCP go to the priority queue, when
+     * the PriorityQueue attribute is set. Only EF (46) does by default. The whole
+     * set can also be given with the PriorityDscps attribute.
+     *
+     * \param dscp the DSCP of packets (a value between 0 and 63).
+     * \param priority true if the packets go to the priority queue.
+     */
+    void SetPriorityDscp(uint8_t dscp, bool priority);
+
+    /**
+     * Get whether packets with the specified DSCP go to the priority queue.
+     *
+     * \param dscp the DSCP of packets (a value between 0 and 63).
+     * \returns true if the packets go to the priority queue.
+     */
+    bool IsPriorityDscp(uint8_t dscp) const;
+
     // Reasons for dropping packets
     static constexpr const char* UNCLASSIFIED_DROP =
         "Unclassified drop"; //!< No packet filter able to classify packet
     static constexpr const char* OVERLIMIT_DROP = "Overlimit drop"; //!< Overlimit dropped packets
+    static constexpr const char* UNFORCED_DROP = "Unforced drop"; //!< Early probability drops
+    static constexpr const char* TARGET_EXCEEDED_DROP =
+        "Target exceeded drop"; //!< Sojourn time above CoDel target
+    static constexpr const char* LIMIT_EXCEEDED_DROP =
+        "Queue disc limit exceeded"; //!< Packets dropped due to queue disc limit exceeded
+    static constexpr const char* POLICED_DROP =
+        "Policed drop"; //!< Priority packets above the rate of the policer
+    // Reasons for marking packets
+    static constexpr const char* UNFORCED_MARK = "Unforced mark"; //!< Early probability marks
+    static constexpr const char* TARGET_EXCEEDED_MARK =
+        "Target exceeded mark"; //!< Sojourn time above CoDel target
+    static constexpr const char* CE_THRESHOLD_EXCEEDED_MARK =
+        "CE threshold exceeded mark"; //!< Sojourn time above CE threshold marks
+    static constexpr const char* STEP_MARK = "Step mark"; //!< L4S sojourn time above step threshold
+    static constexpr const char* COUPLED_MARK = "Coupled mark"; //!< L4S marks coupled to classic
+
+  protected:
+    /**
+     * \brief Dispose of the object
+     */
+    void DoDispose() override;
 
   private:
     bool DoEnqueue(Ptr<QueueDiscItem> item) override;
@@ -148,6 +378,207 @@ class LLQQueueDisc : public QueueDisc
      */
     uint32_t SetAssociativeHash(uint32_t flowHash);
 
+    /**
+     * Compute the hash of the flow of a packet with the configured hash function.
+     * Packets other than IPv4 and IPv6 ones are hashed by the queue disc item.
+     *
+     * \param item the packet
+     * \return the hash of the flow of the packet
+     */
+    uint32_t GetFlowHash(Ptr<QueueDiscItem> item) const;
+
+    /**
+     * Record whether the flow of a bucket is active, for set associative hash.
+     *
+     * \param index the index of the bucket
+     * \param active whether the flow is active
+     */
+    void SetFlowActive(uint32_t index, bool active);
+
+    /**
+     * Update the backlog of a flow queue in the max-heap of the flow backlogs.
+     * A flow queue not in the heap yet is added to it.
+     *
+     * \param index the index of the class of the flow queue
+     * \param bytes the backlog of the flow queue in bytes
+     */
+    void UpdateBacklog(uint32_t index, uint32_t bytes);
+
+    /**
+     * Apply the shared PIE early drop to a packet about to be enqueued into a flow.
+     * The packet is either dropped, marked or left untouched.
+     *
+     * \param item the packet
+     * \param index the index of the flow
+     * \param qSize the current size of the queue of the flow
+     * \return false if the packet has been dropped
+     */
+    bool PieEnqueue(Ptr<QueueDiscItem> item, uint32_t index, QueueSize qSize);
+
+    /**
+     * Update the shared PIE state of a flow with a packet dequeued from it, and
+     * mark the packet if L4S is used and its sojourn time exceeds the CE threshold.
+     *
+     * \param item the packet
+     * \param index the index of the flow
+     * \param empty whether the queue of the flow is empty after the dequeue
+     */
+    void PieDequeue(Ptr<QueueDiscItem> item, uint32_t index, bool empty);
+
+    /**
+     * Periodically update the drop probability of the flows having shared PIE
+     * state, which are kept at the beginning of the state arrays so that the
+     * update loops over contiguous memory without branching.
+     */
+    void PieUpdate();
+
+    /**
+     * Release the shared PIE state at a position of the state arrays, by moving
+     * the state of the last flow in its place.
+     *
+     * \param pos the position of the state
+     */
+    void PieRelease(uint32_t pos);
+
+    /**
+     * Mark a dequeued L4S packet whose sojourn time exceeds the CE threshold,
+     * if L4S is used.
+     *
+     * \param item the packet
+     */
+    void MarkAboveCeThreshold(Ptr<QueueDiscItem> item);
+
+    /**
+     * Dequeue a packet from the queue of a flow.
+     *
+     * \param index the index of the flow
+     * \return the packet, or nullptr if the queue of the flow is empty
+     */
+    Ptr<QueueDiscItem> FlowDequeue(uint32_t index);
+
+    /**
+     * Dequeue a packet from a flow, dropping or marking packets according to
+     * the CoDel state of the flow.
+     *
+     * \param index the index of the flow
+     * \return the packet, or nullptr if the queue of the flow is empty
+     */
+    Ptr<QueueDiscItem> CoDelDequeue(uint32_t index);
+
+    /**
+     * Check whether the sojourn time of a dequeued packet has been above the
+     * CoDel target for at least an interval.
+     *
+     * \param item the packet
+     * \param index the index of the flow
+     * \param now the current time
+     * \return true if CoDel may drop the packet
+     */
+    bool CoDelOkToDrop(Ptr<QueueDiscItem> item, uint32_t index, Time now);
+
+    /**
+     * Reclaim the flows that have been inactive for longer than the idle timeout.
+     * Their buckets are emptied and their classes are kept to be reused by new
+     * flows, which start with a fresh AQM state. Each inactivity period is
+     * examined once, hence the cost is amortized O(1) per packet.
+     */
+    void ReclaimIdleFlows();
+
+    /**
+     * Enqueue a packet into the priority queue, if the policer lets it in.
+     *
+     * \param item the packet
+     * \return false if the packet has been dropped
+     */
+    bool PriorityEnqueue(Ptr<QueueDiscItem> item);
+
+    /**
+     * Enqueue a packet into the L4S queue of the dual queue.
+     *
+     * \param item the packet
+     * \return false if the packet has been dropped
+     */
+    bool L4sEnqueue(Ptr<QueueDiscItem> item);
+
+    /**
+     * Dequeue a packet from the L4S queue of the dual queue, and mark it if its
+     * sojourn time exceeds the step threshold or with the coupled probability.
+     *
+     * \return the packet
+     */
+    Ptr<QueueDiscItem> L4sDequeue();
+
+    /**
+     * Periodically update the base probability of the dual queue from the
+     * queue delay of the classic traffic, i.e., of the flows.
+     */
+    void DualUpdate();
+
+    /**
+     * Get the arrival time of the oldest packet of the classic traffic, which is at the
+     * head of an active flow. Without the flow pool, the heads of the active flows are
+     * scanned.
+     *
+     * \return the arrival time of the oldest classic packet, or the current time if there
+     *         are no classic packets
+     */
+    Time GetClassicHeadTime() const;
+
+    /**
+     * Enqueue a packet into a flow of the flow pool.
+     *
+     * \param item the packet
+     * \param index the index of the flow
+     * \return true if the packet was enqueued
+     */
+    bool PoolEnqueue(Ptr<QueueDiscItem> item, uint32_t index);
+
+    /**
+     * Dequeue a packet from the flows of the flow pool.
+     *
+     * \return the packet, or nullptr if the flows are all empty
+     */
+    Ptr<QueueDiscItem> PoolDequeue();
+
+    /**
+     * Append a packet to the queue of a flow of the flow pool.
+     *
+     * \param item the packet
+     * \param index the index of the flow
+     * \return true if the packet was enqueued
+     */
+    bool PushPacket(Ptr<QueueDiscItem> item, uint32_t index);
+
+    /**
+     * Remove the first packet of the queue of a flow of the flow pool.
+     *
+     * \param index the index of the flow
+     * \return the packet, or nullptr if the queue of the flow is empty
+     */
+    Ptr<QueueDiscItem> PopPacket(uint32_t index);
+
+    /// Index-linked FIFO list of the flows of the flow pool
+    struct FlowIdList
+    {
+        uint32_t head; //!< Index of the first flow (NO_CLASS if the list is empty)
+        uint32_t tail; //!< Index of the last flow (NO_CLASS if the list is empty)
+    };
+
+    /**
+     * Append a flow of the flow pool, which is not in a list, to a list.
+     *
+     * \param list the list
+     * \param index the index of the flow
+     */
+    void PushFlow(FlowIdList& list, uint32_t index);
+
+    /**
+     * Remove the first flow of a non-empty list of flows of the flow pool.
+     *
+     * \param list the list
+     */
+    void PopFlow(FlowIdList& list);
+
     // PIE queue disc parameter
     bool m_useEcn;          //!< True if ECN is used (packets are marked instead of being dropped)
     double m_markEcnTh;     //!< ECN marking threshold (default 10% as suggested in RFC 8033)
@@ -174,12 +605,103 @@ class LLQQueueDisc : public QueueDisc
     uint32_t m_dropBatchSize;        //!< Max number of packets dropped from the fat flow
     uint32_t m_perturbation;         //!< hash perturbation value
     bool m_enableSetAssociativeHash; //!< whether to enable set associative hash
+    HashFunctionType m_hashFunction; //!< hash function used to classify packets
+
+    LLQFlowList m_newFlows; //!< The list of new flows
+    LLQFlowList m_oldFlows; //!< The list of old flows
+
+    static constexpr uint32_t NO_CLASS = UINT32_MAX; //!< No flow queue created for a bucket
+
+    // Flow table, indexed by bucket. The tags and the active ways of a set of the set
+    // associative hash are contiguous, so that a set is probed with a few vector compares.
+    std::vector<uint32_t> m_flowClass;  //!< Class index of each bucket (NO_CLASS if none)
+    std::vector<uint32_t> m_flowTags;   //!< Tag used by set associative hash, by bucket
+    std::vector<uint64_t> m_activeWays; //!< Bitmap of the buckets with an active flow, by set
+
+    std::vector<uint32_t> m_backlog;     //!< Backlog in bytes of each flow queue, by class index
+    std::vector<uint32_t> m_backlogHeap; //!< Max-heap of the class indices by backlog
+    std::vector<uint32_t> m_backlogPos;  //!< Position in the heap of each class index
+
+    // Priority queue, served before the flows and policed by a token bucket
+    // refilled on the arrival of packets
+    bool m_usePriorityQueue;                   //!< True to use the priority queue
+    uint64_t m_priorityDscps;                  //!< Bitmap of the DSCPs of the priority queue
+    DataRate m_priorityRate;                   //!< Token rate of the policer
+    uint32_t m_priorityBurst;                  //!< Bucket size of the policer in bytes
+    double m_priorityTokens;                   //!< Tokens of the policer in bytes
+    Time m_priorityLastRefill;                 //!< Last time tokens were added to the bucket
+    Ptr<Queue<QueueDiscItem>> m_priorityQueue; //!< The priority queue
+
+    // Dual queue coupled AQM (DualPI2, RFC 9332). The flows are the classic queue and the
+    // L4S (ECT(1) and CE) traffic has its own queue, marked with a probability coupled to the
+    // base probability of a PI controller of the classic queue delay.
+    bool m_useDualQueue;                  //!< True to use the dual queue
+    Time m_dualTarget;                    //!< Target classic queue delay
+    double m_dualAlpha;                   //!< Integral gain of the PI controller (Hz)
+    double m_dualBeta;                    //!< Proportional gain of the PI controller (Hz)
+    double m_couplingFactor;              //!< Coupling factor of the L4S marking probability
+    Time m_stepThreshold;                 //!< Sojourn time above which L4S packets are marked
+    Time m_timeShift;                     //!< Time shift of the L4S sojourn times (scheduling)
+    double m_baseProb;                    //!< Base probability of the PI controller
+    double m_classicDelayOld;             //!< Classic queue delay (s) at the previous update
+    EventId m_dualUpdateEvent;            //!< Event used to update the base probability
+    Ptr<Queue<QueueDiscItem>> m_l4sQueue; //!< The L4S queue
+
+    // Shared PIE. The state of a flow is allocated on its first packet and released when
+    // it has decayed to the initial state, by moving the state of the last flow in its place.
+    FlowAqmType m_flowAqm;              //!< Active queue management applied to each flow
+    Ptr<UniformRandomVariable> m_uv;    //!< Rng stream
+    EventId m_pieUpdateEvent;           //!< Event used to update the drop probabilities
+    uint32_t m_pieCount;                //!< Number of flows having shared PIE state
+    std::vector<uint32_t> m_pieSlot;    //!< Position of the state of each flow (or NO_CLASS)
+    std::vector<uint32_t> m_pieFlow;    //!< Flow index, by state position
+    std::vector<double> m_pieDropProb;  //!< Drop probability, by state position
+    std::vector<double> m_pieQDelay;    //!< Current queue delay (s), by state position
+    std::vector<double> m_pieQDelayOld; //!< Old queue delay (s), by state position
+    std::vector<double> m_pieBurst;     //!< Burst allowance (s), by state position
+    std::vector<double> m_pieAccuProb;  //!< Accumulated drop probability, by state position
+
+    /// CoDel state of a flow
+    struct CoDelState
+    {
+        Time firstAboveTime; //!< Time the sojourn time will have been above target for an interval
+        Time dropNext;       //!< Time to drop or mark the next packet in the dropping state
+        uint32_t count;      //!< Number of drops or marks since entering the dropping state
+        uint32_t lastCount;  //!< Count when the dropping state was last entered
+        bool dropping;       //!< True if in the dropping state
+    };
+
+    // CoDel
+    Time m_codelTarget;              //!< CoDel target queue delay
+    Time m_codelInterval;            //!< CoDel interval
+    std::vector<CoDelState> m_codel; //!< CoDel state of each flow, by flow index
+
+    // Idle flow reclamation
+    Time m_idleTimeout;                                //!< Idle timeout (zero to disable)
+    std::deque<std::pair<uint32_t, Time>> m_idleFlows; //!< Inactivity periods, oldest first
+    std::vector<Time> m_idleSince;                     //!< Start of inactivity, by class index
+    std::vector<uint32_t> m_freeClasses;               //!< Class indices of the reclaimed flows
+    TracedValue<uint32_t> m_liveFlows;                 //!< Number of live flows
 
-    std::list<Ptr<LLQFlow>> m_newFlows; //!< The list of new flows
-    std::list<Ptr<LLQFlow>> m_oldFlows; //!< The list of old flows
+    // Flow pool, i.e., the state of all the flows preallocated as a struct of arrays indexed by
+    // bucket. The packets of all the flows are stored in a single internal queue, and the
+    // packets of a flow are linked, oldest first, through the slots of a shared slab holding
+    // their positions in that queue. The slots of the dequeued packets are reused.
+    bool m_useFlowPool;                  //!< True to preallocate all the flows in the flow pool
+    std::vector<int32_t> m_poolDeficit;  //!< Deficit of each flow
+    std::vector<uint8_t> m_poolStatus;   //!< Status (LLQFlow::FlowStatus) of each flow
+    std::vector<uint32_t> m_poolNext;    //!< Next flow in the list of new or old flows
+    std::vector<uint32_t> m_poolHead;    //!< Slot of the first packet of each flow (or NO_CLASS)
+    std::vector<uint32_t> m_poolTail;    //!< Slot of the last packet of each flow (or NO_CLASS)
+    std::vector<uint32_t> m_poolPackets; //!< Number of packets queued in each flow
+    std::vector<uint32_t> m_poolBytes;   //!< Number of bytes queued in each flow
+    FlowIdList m_newPool;                //!< The list of new flows of the flow pool
+    FlowIdList m_oldPool;                //!< The list of old flows of the flow pool
 
-    std::map<uint32_t, uint32_t> m_flowsIndices; //!< Map with the index of class for each flow
-    std::map<uint32_t, uint32_t> m_tags;         //!< Tags used by set associative hash
+    Ptr<LLQPoolQueue> m_poolQueue;                      //!< Queue of the pool packets
+    std::vector<LLQPoolQueue::ConstIterator> m_slabPos; //!< Position of the packet of a slot
+    std::vector<uint32_t> m_slabNext;                   //!< Next slot of the flow, or free slot
+    uint32_t m_slabFree;                                //!< First free slot (or NO_CLASS)
 
     ObjectFactory m_flowFactory;      //!< Factory to create a new flow
     ObjectFactory m_queueDiscFactory; //!< Factory to create a new queue
@@ -1,12 +1,31 @@
 #include "wfq-queue-disc.h"
 
+#include "fifo-queue-disc.h"
+
+#include "ns3/abort.h"
+#include "ns3/boolean.h"
+#include "ns3/double.h"
+#include "ns3/enum.h"
 #include "ns3/log.h"
+#include "ns3/net-device-queue-interface.h"
 #include "ns3/object-factory.h"
 #include "ns3/pointer.h"
+#include "ns3/queue-size.h"
+#include "ns3/simulator.h"
 #include "ns3/socket.h"
+#include "ns3/string.h"
+#include "ns3/type-id.h"
+#include "ns3/uinteger.h"
 
 #include <algorithm>
+#include <cmath>
 #include <iterator>
+#include <limits>
+#include <sstream>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <tmmintrin.h>
+#endif
 
 namespace ns3
 {
@@ -16,6 +35,50 @@ NS_LOG_COMPONENT_DEFINE("WFQQueueDisc");
 NS_OBJECT_ENSURE_REGISTERED(WFQQueueDisc);
 
 ATTRIBUTE_HELPER_CPP(WFQmap);
+ATTRIBUTE_HELPER_CPP(WFQweights);
+
+/**
+ * \brief Compare two virtual times, which wrap around
+ * \param a the first virtual time
+ * \param b the second virtual time
+ * \return true if a precedes b
+ */
+static inline bool
+VirtualTimeBefore(uint64_t a, uint64_t b)
+{
+    return static_cast<int64_t>(a - b) < 0;
+}
+
+/**
+ * \brief Get the latest of two virtual times, which wrap around
+ * \param a the first virtual time
+ * \param b the second virtual time
+ * \return the latest virtual time
+ */
+static inline uint64_t
+VirtualTimeMax(uint64_t a, uint64_t b)
+{
+    return VirtualTimeBefore(a, b) ? b : a;
+}
+
+/**
+ * \brief Order heap entries by virtual time, then by band, so that the
+ * standard heap algorithms build min-heaps of wrapping virtual times
+ */
+struct HeapGreater
+{
+    /**
+     * \param a the first heap entry
+     * \param b the second heap entry
+     * \return true if a follows b
+     */
+    bool operator()(const std::pair<uint64_t, uint32_t>& a,
+                    const std::pair<uint64_t, uint32_t>& b) const
+    {
+        return VirtualTimeBefore(b.first, a.first) ||
+               (a.first == b.first && a.second > b.second);
+    }
+};
 
 std::ostream&
 operator<<(std::ostream& os, const WFQmap& priomap)
@@ -39,6 +102,28 @@ operator>>(std::istream& is, WFQmap& priomap)
     return is;
 }
 
+std::ostream&
+operator<<(std::ostream& os, const WFQweights& weights)
+{
+    std::copy(weights.begin(), weights.end() - 1, std::ostream_iterator<uint32_t>(os, " "));
+    os << weights.back();
+    return os;
+}
+
+std::istream&
+operator>>(std::istream& is, WFQweights& weights)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        if (!(is >> weights[i]))
+        {
+            NS_FATAL_ERROR("Incomplete weights specification ("
+                           << i << " values provided, 16 required)");
+        }
+    }
+    return is;
+}
+
 TypeId
 WFQQueueDisc::GetTypeId()
 {
@@ -51,14 +136,126 @@ WFQQueueDisc::GetTypeId()
                           "The priority to band mapping.",
                           WFQmapValue(WFQmap{{1, 2, 2, 2, 1, 2, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1}}),
                           MakeWFQmapAccessor(&WFQQueueDisc::m_prio2band),
-                          MakeWFQmapChecker());
+                          MakeWFQmapChecker())
+            .AddAttribute("ClassifyByDscp",
+                          "Whether to classify packets by the DSCP field of their IP header "
+                          "instead of by their priority tag",
+                          BooleanValue(false),
+                          MakeBooleanAccessor(&WFQQueueDisc::m_classifyByDscp),
+                          MakeBooleanChecker())
+            .AddAttribute("ChildQueueDiscType",
+                          "The type of the child queue discs created when no class is configured",
+                          TypeIdValue(FifoQueueDisc::GetTypeId()),
+                          MakeTypeIdAccessor(&WFQQueueDisc::m_childType),
+                          MakeTypeIdChecker())
+            .AddAttribute("Weights",
+                          "The weight of each band.",
+                          WFQweightsValue(
+                              WFQweights{{1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1}}),
+                          MakeWFQweightsAccessor(&WFQQueueDisc::m_weights),
+                          MakeWFQweightsChecker())
+            .AddAttribute("Scheduler",
+                          "The discipline used to serve the bands",
+                          EnumValue(WFQQueueDisc::WF2Q_PLUS),
+                          MakeEnumAccessor<SchedulerType>(&WFQQueueDisc::m_scheduler),
+                          MakeEnumChecker(WFQQueueDisc::STRICT_PRIORITY,
+                                          "StrictPriority",
+                                          WFQQueueDisc::WFQ,
+                                          "WFQ",
+                                          WFQQueueDisc::DRR,
+                                          "DRR",
+                                          WFQQueueDisc::WF2Q_PLUS,
+                                          "WF2Q+",
+                                          WFQQueueDisc::BUCKETED_WFQ,
+                                          "BucketedWFQ"))
+            .AddAttribute("RankBuckets",
+                          "The number of buckets ranking the bands in BucketedWFQ mode "
+                          "(a power of two)",
+                          UintegerValue(1024),
+                          MakeUintegerAccessor(&WFQQueueDisc::m_rankBuckets),
+                          MakeUintegerChecker<uint32_t>(1, BucketQueue::MAX_BUCKETS))
+            .AddAttribute("RankGranularity",
+                          "The virtual time, in bytes per unit weight, or the ranks, if a rank "
+                          "function is set, covered by each bucket in BucketedWFQ mode (a power "
+                          "of two)",
+                          UintegerValue(64),
+                          MakeUintegerAccessor(&WFQQueueDisc::m_rankGranularity),
+                          MakeUintegerChecker<uint32_t>(1))
+            .AddAttribute("Quantum",
+                          "The deficit of a band of unit weight at each DRR round "
+                          "(0 to use the MTU of the device)",
+                          UintegerValue(0),
+                          MakeUintegerAccessor(&WFQQueueDisc::SetQuantum,
+                                               &WFQQueueDisc::GetQuantum),
+                          MakeUintegerChecker<uint32_t>())
+            .AddAttribute("LinkSharingBurst",
+                          "The depth in bytes of the token buckets of the link-sharing classes",
+                          UintegerValue(15000),
+                          MakeUintegerAccessor(&WFQQueueDisc::m_burst),
+                          MakeUintegerChecker<uint32_t>(1))
+            .AddAttribute("SharedBuffer",
+                          "Whether the bands share a buffer of MaxSize, with dynamic thresholds",
+                          BooleanValue(false),
+                          MakeBooleanAccessor(&WFQQueueDisc::m_sharedBuffer),
+                          MakeBooleanChecker())
+            .AddAttribute("MaxSize",
+                          "The size of the buffer shared by the bands",
+                          QueueSizeValue(QueueSize("1000p")),
+                          MakeQueueSizeAccessor(&QueueDisc::SetMaxSize, &QueueDisc::GetMaxSize),
+                          MakeQueueSizeChecker())
+            .AddAttribute("DynamicThresholdAlpha",
+                          "The multiple of the free space of the shared buffer a band can hold",
+                          DoubleValue(1.0),
+                          MakeDoubleAccessor(&WFQQueueDisc::m_dtAlpha),
+                          MakeDoubleChecker<double>(0))
+            .AddAttribute("PushOut",
+                          "Whether the packets not fitting the shared buffer push out the "
+                          "packets of the lower priority bands",
+                          BooleanValue(true),
+                          MakeBooleanAccessor(&WFQQueueDisc::m_pushOut),
+                          MakeBooleanChecker())
+            .AddAttribute("LinkRate",
+                          "The rate of the link, used to compute the delay and backlog bounds",
+                          DataRateValue(DataRate("0bps")),
+                          MakeDataRateAccessor(&WFQQueueDisc::m_linkRate),
+                          MakeDataRateChecker())
+            .AddAttribute("MaxPacketSize",
+                          "The size of the largest packet, used to compute the delay and "
+                          "backlog bounds",
+                          UintegerValue(1500),
+                          MakeUintegerAccessor(&WFQQueueDisc::m_maxPacketSize),
+                          MakeUintegerChecker<uint32_t>(1))
+            .AddAttribute("SojournHistograms",
+                          "The histograms of the sojourn time of the packets of each band",
+                          TypeId::ATTR_GET,
+                          StringValue(""),
+                          MakeStringAccessor(&WFQQueueDisc::GetSojournHistograms),
+                          MakeStringChecker())
+            .AddTraceSource("BandEnqueue",
+                            "Enqueue of a packet in a band",
+                            MakeTraceSourceAccessor(&WFQQueueDisc::m_traceBandEnqueue),
+                            "ns3::WFQQueueDisc::BandTracedCallback")
+            .AddTraceSource("BandDequeue",
+                            "Dequeue of a packet from a band",
+                            MakeTraceSourceAccessor(&WFQQueueDisc::m_traceBandDequeue),
+                            "ns3::WFQQueueDisc::BandTracedCallback");
     return tid;
 }
 
 WFQQueueDisc::WFQQueueDisc()
-    : QueueDisc(QueueDiscSizePolicy::NO_LIMITS)
+    : QueueDisc(QueueDiscSizePolicy::MULTIPLE_QUEUES),
+      m_virtualTime(0),
+      m_defaultBands(3),
+      m_invWeightSum(0),
+      m_quantum(0),
+      m_activeMask(0),
+      m_peekedBand(NO_BAND),
+      m_bandClass(32, ROOT_CLASS),
+      m_guarantee(32),
+      m_batchBand(NO_BAND)
 {
     NS_LOG_FUNCTION(this);
+    m_dscp2band.fill(DSCP_UNSET);
 }
 
 WFQQueueDisc::~WFQQueueDisc()
@@ -66,6 +263,20 @@ WFQQueueDisc::~WFQQueueDisc()
     NS_LOG_FUNCTION(this);
 }
 
+void
+WFQQueueDisc::DoDispose()
+{
+    NS_LOG_FUNCTION(this);
+    m_bands.clear();
+    m_heap.clear();
+    m_startHeap.clear();
+    m_activeBands.clear();
+    m_sojourn.clear();
+    m_rankFunction = MakeNullCallback<uint64_t, uint32_t, Ptr<const QueueDiscItem>>();
+    Simulator::Cancel(m_wakeEvent);
+    QueueDisc::DoDispose();
+}
+
 void
 WFQQueueDisc::SetBandForWFQrity(uint8_t prio, uint16_t band)
 {
@@ -86,129 +297,1388 @@ WFQQueueDisc::GetBandForWFQrity(uint8_t prio) const
     return m_prio2band[prio];
 }
 
-bool
-WFQQueueDisc::DoEnqueue(Ptr<QueueDiscItem> item)
+void
+WFQQueueDisc::SetBandForDscp(uint8_t dscp, uint16_t band)
 {
-    NS_LOG_FUNCTION(this << item);
+    NS_LOG_FUNCTION(this << dscp << band);
 
-    uint32_t band = m_prio2band[0];
+    NS_ASSERT_MSG(dscp < 64, "DSCP must be a value between 0 and 63");
+    NS_ASSERT_MSG(band < DSCP_UNSET, "Band out of range");
+
+    m_dscp2band[dscp] = band;
+}
+
+uint16_t
+WFQQueueDisc::GetBandForDscp(uint8_t dscp) const
+{
+    NS_LOG_FUNCTION(this << dscp);
+
+    NS_ASSERT_MSG(dscp < 64, "DSCP must be a value between 0 and 63");
+
+    if (m_dscp2band[dscp] == DSCP_UNSET)
+    {
+        return m_prio2band[Socket::IpTos2Priority(dscp << 2) & 0x0f];
+    }
+    return m_dscp2band[dscp];
+}
+
+void
+WFQQueueDisc::SetBandWeight(uint16_t band, uint32_t weight)
+{
+    NS_LOG_FUNCTION(this << band << weight);
+
+    NS_ASSERT_MSG(band < 16, "Band must be a value between 0 and 15");
+    NS_ASSERT_MSG(weight > 0, "The weight of a band cannot be null");
+
+    m_weights[band] = weight;
+}
+
+uint32_t
+WFQQueueDisc::GetBandWeight(uint16_t band) const
+{
+    NS_LOG_FUNCTION(this << band);
+
+    NS_ASSERT_MSG(band < 16, "Band must be a value between 0 and 15");
+
+    return m_weights[band];
+}
+
+void
+WFQQueueDisc::SetQuantum(uint32_t quantum)
+{
+    NS_LOG_FUNCTION(this << quantum);
+    m_quantum = quantum;
+}
+
+uint32_t
+WFQQueueDisc::GetQuantum() const
+{
+    return m_quantum;
+}
+
+void
+WFQQueueDisc::SetRankFunction(RankCallback rank)
+{
+    NS_LOG_FUNCTION(this);
+    m_rankFunction = rank;
+}
+
+uint32_t
+WFQQueueDisc::GetSojournBucket(uint64_t ns)
+{
+    ns = std::min<uint64_t>(ns, (uint64_t(1) << HIST_MAX_BITS) - 1);
+
+    if (ns < (1U << HIST_SUB_BITS))
+    {
+        return ns;
+    }
+
+    uint32_t msb = 63 - __builtin_clzll(ns);
+    uint32_t sub = (ns >> (msb - HIST_SUB_BITS)) & ((1U << HIST_SUB_BITS) - 1);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) | sub;
+}
+
+uint64_t
+WFQQueueDisc::GetBucketLowerBound(uint32_t bucket)
+{
+    uint32_t exp = bucket >> HIST_SUB_BITS;
 
-    int32_t ret = Classify(item);
+    if (exp == 0)
+    {
+        return bucket;
+    }
+
+    uint64_t sub = bucket & ((1U << HIST_SUB_BITS) - 1);
+    return ((uint64_t(1) << HIST_SUB_BITS) + sub) << (exp - 1);
+}
+
+void
+WFQQueueDisc::SetBandArrivalCurve(uint16_t band, uint32_t burst, DataRate rate)
+{
+    NS_LOG_FUNCTION(this << band << burst << rate);
+
+    NS_ABORT_MSG_IF(band >= m_guarantee.size(), "Band out of range");
 
-    if (ret == PacketFilter::PF_NO_MATCH)
+    m_guarantee[band].constrained = true;
+    m_guarantee[band].burst = burst;
+    m_guarantee[band].rate = rate;
+}
+
+bool
+WFQQueueDisc::GetServiceCurve(uint32_t band, double& rate, double& latency) const
+{
+    uint32_t nBands = (GetNQueueDiscClasses() ? GetNQueueDiscClasses() : m_defaultBands);
+    double link = m_linkRate.GetBitRate() / 8.0;
+    double maxSize = m_maxPacketSize;
+
+    if (band >= nBands || link <= 0)
     {
-        NS_LOG_DEBUG("No filter has been able to classify this packet, using priomap.");
+        return false;
+    }
 
-        SocketPriorityTag priorityTag;
-        if (item->GetPacket()->PeekPacketTag(priorityTag))
+    if (m_scheduler == STRICT_PRIORITY)
+    {
+        // the band is served at the rate left by the higher priority bands,
+        // after their bursts and a lower priority packet in transmission
+        double bursts = 0;
+        rate = link;
+        for (uint32_t i = 0; i < band; i++)
         {
-            band = m_prio2band[priorityTag.GetPriority() & 0x0f];
+            if (!m_guarantee[i].constrained)
+            {
+                return false;
+            }
+            bursts += m_guarantee[i].burst;
+            rate -= m_guarantee[i].rate.GetBitRate() / 8.0;
         }
+        if (rate <= 0)
+        {
+            return false;
+        }
+        latency = (bursts + maxSize) / rate;
+        return true;
     }
-    else
+
+    if (nBands > m_weights.size())
     {
-        NS_LOG_DEBUG("Packet filters returned " << ret);
+        return false;
+    }
+
+    double weightSum = 0;
+    for (uint32_t i = 0; i < nBands; i++)
+    {
+        weightSum += m_weights[i];
+    }
+    rate = link * m_weights[band] / weightSum;
+
+    if (m_scheduler == WF2Q_PLUS)
+    {
+        latency = maxSize / rate + maxSize / link;
+    }
+    else if (m_scheduler == BUCKETED_WFQ && !m_rankFunction.IsNull())
+    {
+        // the service depends on the rank function
+        return false;
+    }
+    else if (m_scheduler == WFQ || m_scheduler == BUCKETED_WFQ)
+    {
+        // the virtual time is the finish tag of the packet in service (SCFQ)
+        latency = maxSize / rate + (nBands - 1) * maxSize / link;
 
-        if (ret >= 0 && static_cast<uint32_t>(ret) < GetNQueueDiscClasses())
+        // the packets of the other bands within a bucket may be served first
+        if (m_scheduler == BUCKETED_WFQ)
         {
-            band = ret;
+            latency += static_cast<double>(m_rankGranularity) * weightSum / link;
         }
     }
+    else
+    {
+        // latency of DRR, with frame F = sum of the quanta: (3F - 2Q) / C
+        double quantum = (m_quantum ? m_quantum : maxSize);
+        latency = (3 * quantum * weightSum - 2 * quantum * m_weights[band]) / link;
+    }
+    return true;
+}
+
+Time
+WFQQueueDisc::GetBandDelayBound(uint16_t band) const
+{
+    NS_LOG_FUNCTION(this << band);
 
-    NS_ASSERT_MSG(band < GetNQueueDiscClasses(), "Selected band out of range");
-    bool retval = GetQueueDiscClass(band)->GetQueueDisc()->Enqueue(item);
+    NS_ABORT_MSG_IF(band >= m_guarantee.size(), "Band out of range");
 
-    // If Queue::Enqueue fails, QueueDisc::Drop is called by the child queue disc
-    // because QueueDisc::AddQueueDiscClass sets the drop callback
+    const BandGuarantee& g = m_guarantee[band];
+    double rate;
+    double latency;
 
-    NS_LOG_LOGIC("Number packets band " << band << ": "
-                                        << GetQueueDiscClass(band)->GetQueueDisc()->GetNPackets());
+    if (!g.constrained || !GetServiceCurve(band, rate, latency) ||
+        g.rate.GetBitRate() / 8.0 > rate)
+    {
+        return Time::Max();
+    }
 
-    return retval;
+    // horizontal deviation between the token bucket and the rate-latency curve
+    return Seconds(latency + g.burst / rate);
 }
 
-Ptr<QueueDiscItem>
-WFQQueueDisc::DoDequeue()
+uint32_t
+WFQQueueDisc::GetBandBacklogBound(uint16_t band) const
 {
-    NS_LOG_FUNCTION(this);
+    NS_LOG_FUNCTION(this << band);
 
-    Ptr<QueueDiscItem> item;
+    NS_ABORT_MSG_IF(band >= m_guarantee.size(), "Band out of range");
+
+    const BandGuarantee& g = m_guarantee[band];
+    double rate;
+    double latency;
+
+    if (!g.constrained || !GetServiceCurve(band, rate, latency) ||
+        g.rate.GetBitRate() / 8.0 > rate)
+    {
+        return UINT32_MAX;
+    }
+
+    // vertical deviation between the token bucket and the rate-latency curve
+    return std::min<double>(std::ceil(g.burst + g.rate.GetBitRate() / 8.0 * latency),
+                            UINT32_MAX);
+}
 
-    for (uint32_t i = 0; i < GetNQueueDiscClasses(); i++)
+bool
+WFQQueueDisc::CheckGuarantees() const
+{
+    for (uint32_t band = 0; band < m_guarantee.size(); band++)
     {
-        if ((item = GetQueueDiscClass(i)->GetQueueDisc()->Dequeue()))
+        if (m_guarantee[band].delay != Time::Max() &&
+            GetBandDelayBound(band) > m_guarantee[band].delay)
         {
-            NS_LOG_LOGIC("Popped from band " << i << ": " << item);
-            NS_LOG_LOGIC("Number packets band "
-                         << i << ": " << GetQueueDiscClass(i)->GetQueueDisc()->GetNPackets());
-            return item;
+            NS_LOG_LOGIC("Delay bound of band " << band << " (" << GetBandDelayBound(band)
+                                                << ") exceeds " << m_guarantee[band].delay);
+            return false;
         }
     }
-
-    NS_LOG_LOGIC("Queue empty");
-    return item;
+    return true;
 }
 
-Ptr<const QueueDiscItem>
-WFQQueueDisc::DoPeek()
+bool
+WFQQueueDisc::ReserveBand(uint16_t band, uint32_t burst, DataRate rate, Time delay)
 {
-    NS_LOG_FUNCTION(this);
+    NS_LOG_FUNCTION(this << band << burst << rate << delay);
 
-    Ptr<const QueueDiscItem> item;
+    NS_ABORT_MSG_IF(band >= m_guarantee.size(), "Band out of range");
+
+    BandGuarantee old = m_guarantee[band];
+    SetBandArrivalCurve(band, burst, rate);
+    m_guarantee[band].delay = delay;
+
+    if (!CheckGuarantees())
+    {
+        NS_LOG_DEBUG("Reservation for band " << band << " rejected");
+        m_guarantee[band] = old;
+        return false;
+    }
+    return true;
+}
+
+std::string
+WFQQueueDisc::GetSojournHistograms() const
+{
+    std::ostringstream oss;
 
-    for (uint32_t i = 0; i < GetNQueueDiscClasses(); i++)
+    for (uint32_t band = 0; band < m_sojourn.size(); band++)
     {
-        if ((item = GetQueueDiscClass(i)->GetQueueDisc()->Peek()))
+        for (uint32_t i = 0; i < HIST_BUCKETS; i++)
         {
-            NS_LOG_LOGIC("Peeked from band " << i << ": " << item);
-            NS_LOG_LOGIC("Number packets band "
-                         << i << ": " << GetQueueDiscClass(i)->GetQueueDisc()->GetNPackets());
-            return item;
+            if (m_sojourn[band][i])
+            {
+                oss << band << " " << GetBucketLowerBound(i) << " "
+                    << GetBucketLowerBound(i + 1) - 1 << " " << m_sojourn[band][i] << "\n";
+            }
         }
     }
-
-    NS_LOG_LOGIC("Queue empty");
-    return item;
+    return oss.str();
 }
 
-bool
-WFQQueueDisc::CheckConfig()
+Time
+WFQQueueDisc::GetSojournPercentile(uint32_t band, double percentile) const
 {
-    NS_LOG_FUNCTION(this);
-    if (GetNInternalQueues() > 0)
+    NS_LOG_FUNCTION(this << band << percentile);
+
+    NS_ASSERT_MSG(percentile >= 0 && percentile <= 100, "Percentile out of range");
+
+    if (band >= m_sojourn.size())
     {
-        NS_LOG_ERROR("WFQQueueDisc cannot have internal queues");
-        return false;
+        return Time(0);
     }
 
-    if (GetNQueueDiscClasses() == 0)
+    const SojournHistogram& hist = m_sojourn[band];
+    uint64_t total = 0;
+    for (uint32_t count : hist)
+    {
+        total += count;
+    }
+
+    uint64_t target = std::max<uint64_t>(1, std::ceil(percentile / 100 * total));
+    uint64_t cumulative = 0;
+    for (uint32_t i = 0; i < HIST_BUCKETS && total; i++)
     {
-        // create 3 fifo queue discs
-        ObjectFactory factory;
-        factory.SetTypeId("ns3::FifoQueueDisc");
-        for (uint8_t i = 0; i < 2; i++)
+        cumulative += hist[i];
+        if (cumulative >= target)
         {
-            Ptr<QueueDisc> qd = factory.Create<QueueDisc>();
-            qd->Initialize();
-            Ptr<QueueDiscClass> c = CreateObject<QueueDiscClass>();
-            c->SetQueueDisc(qd);
-            AddQueueDiscClass(c);
+            return NanoSeconds(GetBucketLowerBound(i + 1) - 1);
         }
     }
+    return Time(0);
+}
 
-    if (GetNQueueDiscClasses() < 2)
+void
+WFQQueueDisc::SetChildQueueDiscAttribute(std::string name, const AttributeValue& value)
+{
+    NS_LOG_FUNCTION(this << name);
+
+    m_childAttrs.push_back({ALL_BANDS, name, value.Copy()});
+}
+
+void
+WFQQueueDisc::SetChildQueueDiscAttribute(uint16_t band,
+                                         std::string name,
+                                         const AttributeValue& value)
+{
+    NS_LOG_FUNCTION(this << band << name);
+
+    NS_ASSERT_MSG(band < ALL_BANDS, "Band out of range");
+
+    m_childAttrs.push_back({band, name, value.Copy()});
+}
+
+uint32_t
+WFQQueueDisc::AddLinkSharingClass(uint32_t parent, DataRate rate, DataRate ceil)
+{
+    NS_LOG_FUNCTION(this << parent << rate << ceil);
+
+    NS_ABORT_MSG_IF(parent != ROOT_CLASS && parent >= m_classes.size(),
+                    "The parent link-sharing class does not exist");
+    NS_ABORT_MSG_IF(rate.GetBitRate() == 0, "The rate of a link-sharing class cannot be null");
+    NS_ABORT_MSG_IF(ceil < rate, "The ceil of a link-sharing class cannot be below its rate");
+
+    m_classes.push_back({parent, rate, ceil, 0, 0});
+    return m_classes.size() - 1;
+}
+
+uint32_t
+WFQQueueDisc::SetBandLinkSharing(uint16_t band, uint32_t parent, DataRate rate, DataRate ceil)
+{
+    NS_LOG_FUNCTION(this << band << parent << rate << ceil);
+
+    NS_ABORT_MSG_IF(band >= m_bandClass.size(), "Band out of range");
+    NS_ABORT_MSG_IF(m_bandClass[band] != ROOT_CLASS, "The band already is a link-sharing class");
+
+    m_bandClass[band] = AddLinkSharingClass(parent, rate, ceil);
+    return m_bandClass[band];
+}
+
+void
+WFQQueueDisc::SyncBand(uint32_t band)
+{
+    BandState& state = m_bands[band];
+    uint32_t nPackets = state.qd->GetNPackets();
+
+    if (nPackets)
     {
-        NS_LOG_ERROR("WFQQueueDisc needs at least 2 classes");
-        return false;
+        m_activeMask |= (1U << band);
+    }
+    else
+    {
+        m_activeMask &= ~(1U << band);
     }
 
-    return true;
+    // the child queue disc drops packets from the head of its queue, except
+    // for the arriving packets, whose tag is never stored
+    bool headDropped = false;
+    while (state.tags.size() > nPackets)
+    {
+        state.tags.pop_front();
+        headDropped = true;
+    }
+
+    // unlike heap entries, the rank of a band is updated as soon as its head changes
+    if (headDropped && m_scheduler == BUCKETED_WFQ && state.inHeap)
+    {
+        PopBand(band);
+        PushBand(band);
+    }
 }
 
 void
-WFQQueueDisc::InitializeParams()
+WFQQueueDisc::PushBand(uint32_t band)
 {
-    NS_LOG_FUNCTION(this);
+    BandState& state = m_bands[band];
+
+    if (state.inHeap || state.tags.empty())
+    {
+        return;
+    }
+
+    const VirtualTags& head = state.tags.front();
+
+    if (m_scheduler == BUCKETED_WFQ)
+    {
+        uint64_t rank = head.finish;
+        if (!m_rankFunction.IsNull())
+        {
+            Ptr<const QueueDiscItem> item = state.qd->Peek();
+            // the child queue disc may drop packets when peeked
+            SyncBand(band);
+            if (!item)
+            {
+                return;
+            }
+            rank = m_rankFunction(band, item);
+        }
+        m_rankQueue.Push(band, rank);
+    }
+    else if (m_scheduler == WF2Q_PLUS && VirtualTimeBefore(m_virtualTime, head.start))
+    {
+        m_startHeap.emplace_back(head.start, band);
+        std::push_heap(m_startHeap.begin(), m_startHeap.end(), HeapGreater());
+    }
+    else
+    {
+        m_heap.emplace_back(head.finish, band);
+        std::push_heap(m_heap.begin(), m_heap.end(), HeapGreater());
+    }
+    state.inHeap = true;
+}
+
+void
+WFQQueueDisc::PopBand(uint32_t band)
+{
+    if (m_scheduler == BUCKETED_WFQ)
+    {
+        m_rankQueue.Remove(band);
+    }
+    else if (m_heap.front().second == band)
+    {
+        std::pop_heap(m_heap.begin(), m_heap.end(), HeapGreater());
+        m_heap.pop_back();
+    }
+    else
+    {
+        // the band has been selected while shaping kept the top bands out
+        auto it = std::find_if(m_heap.begin(), m_heap.end(), [band](const HeapEntry& e) {
+            return e.second == band;
+        });
+        NS_ASSERT_MSG(it != m_heap.end(), "Band not in the heap");
+        *it = m_heap.back();
+        m_heap.pop_back();
+        std::make_heap(m_heap.begin(), m_heap.end(), HeapGreater());
+    }
+    m_bands[band].inHeap = false;
+}
+
+bool
+WFQQueueDisc::GetHeadBand(uint32_t& band, uint32_t allowed)
+{
+    bool found = false;
+
+    while (!m_heap.empty())
+    {
+        HeapEntry top = m_heap.front();
+        BandState& state = m_bands[top.second];
+        bool stale = (state.tags.empty() || state.tags.front().finish != top.first);
+
+        if (!stale && (allowed & (1U << top.second)))
+        {
+            band = top.second;
+            found = true;
+            break;
+        }
+
+        std::pop_heap(m_heap.begin(), m_heap.end(), HeapGreater());
+        m_heap.pop_back();
+
+        if (stale)
+        {
+            // the head of the band has been dropped since the entry was pushed
+            state.inHeap = false;
+            PushBand(top.second);
+        }
+        else
+        {
+            NS_LOG_LOGIC("Band " << top.second << " cannot be served now");
+            m_parked.push_back(top);
+        }
+    }
+
+    // put back the entries of the bands shaped out
+    for (const auto& entry : m_parked)
+    {
+        m_heap.push_back(entry);
+        std::push_heap(m_heap.begin(), m_heap.end(), HeapGreater());
+    }
+    m_parked.clear();
+
+    return found;
+}
+
+bool
+WFQQueueDisc::GetEligibleBand(uint32_t& band, uint32_t allowed)
+{
+    while (true)
+    {
+        // move the bands whose head became eligible to the heap
+        while (!m_startHeap.empty() && !VirtualTimeBefore(m_virtualTime, m_startHeap.front().first))
+        {
+            uint32_t b = m_startHeap.front().second;
+            std::pop_heap(m_startHeap.begin(), m_startHeap.end(), HeapGreater());
+            m_startHeap.pop_back();
+            m_bands[b].inHeap = false;
+            PushBand(b);
+        }
+
+        if (GetHeadBand(band, allowed))
+        {
+            return true;
+        }
+
+        // V = max (V, min S), where the minimum is taken over the bands that
+        // can be served: the eligible bands, if any, are all shaped out
+        bool found = false;
+        VirtualTime minStart = 0;
+        for (const auto& entry : m_startHeap)
+        {
+            if ((allowed & (1U << entry.second)) &&
+                (!found || VirtualTimeBefore(entry.first, minStart)))
+            {
+                minStart = entry.first;
+                found = true;
+            }
+        }
+
+        if (!found)
+        {
+            return false;
+        }
+
+        m_virtualTime = VirtualTimeMax(m_virtualTime, minStart);
+        NS_LOG_LOGIC("No eligible band can be served, virtual time advanced to "
+                     << m_virtualTime);
+    }
+}
+
+bool
+WFQQueueDisc::GetDrrBand(uint32_t& band, uint32_t allowed)
+{
+    uint32_t skipped = 0;
+
+    while (!m_activeBands.empty() && skipped < m_activeBands.size())
+    {
+        band = m_activeBands.front();
+        BandState& state = m_bands[band];
+
+        if (!(m_activeMask & (1U << band)))
+        {
+            NS_LOG_DEBUG("Band " << band << " is empty, remove it from the active list");
+            state.active = false;
+            m_activeBands.pop_front();
+        }
+        else if (!(allowed & (1U << band)))
+        {
+            NS_LOG_LOGIC("Band " << band << " cannot be served now");
+            m_activeBands.pop_front();
+            m_activeBands.push_back(band);
+            skipped++;
+        }
+        else if (state.deficit <= 0)
+        {
+            NS_LOG_DEBUG("Increase deficit for band " << band);
+            state.deficit += m_quantum * m_weights[band];
+            m_activeBands.pop_front();
+            m_activeBands.push_back(band);
+            skipped = 0;
+        }
+        else
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool
+WFQQueueDisc::GetRankedBand(uint32_t& band, uint32_t allowed)
+{
+    for (uint32_t b = m_rankQueue.GetFirst(); b != BucketQueue::NONE; b = m_rankQueue.GetNext(b))
+    {
+        if (allowed & (1U << b))
+        {
+            band = b;
+            return true;
+        }
+        NS_LOG_LOGIC("Band " << b << " cannot be served now");
+    }
+    return false;
+}
+
+bool
+WFQQueueDisc::SelectBand(uint32_t& band, uint32_t allowed)
+{
+    if (m_peekedBand != NO_BAND)
+    {
+        NS_LOG_LOGIC("Using the band found by the last peek: " << m_peekedBand);
+        band = m_peekedBand;
+        return true;
+    }
+
+    switch (m_scheduler)
+    {
+    case WFQ:
+        return GetHeadBand(band, allowed);
+    case WF2Q_PLUS:
+        return GetEligibleBand(band, allowed);
+    case DRR:
+        return GetDrrBand(band, allowed);
+    case BUCKETED_WFQ:
+        return GetRankedBand(band, allowed);
+    default:
+        if (!(m_activeMask & allowed))
+        {
+            return false;
+        }
+        band = __builtin_ctz(m_activeMask & allowed);
+        return true;
+    }
+}
+
+uint32_t
+WFQQueueDisc::GetSendableBands()
+{
+    Time now = Simulator::Now();
+    double elapsed = (now - m_lastRefill).GetSeconds();
+    m_lastRefill = now;
+
+    for (auto& c : m_classes)
+    {
+        c.tokens = std::min<double>(c.tokens + elapsed * c.rate.GetBitRate() / 8, m_burst);
+        c.ctokens = std::min<double>(c.ctokens + elapsed * c.ceil.GetBitRate() / 8, m_burst);
+    }
+
+    uint32_t withinRate = 0;
+    uint32_t borrowing = 0;
+
+    for (uint32_t mask = m_activeMask; mask; mask &= mask - 1)
+    {
+        uint32_t band = __builtin_ctz(mask);
+        uint32_t leaf = m_bandClass[band];
+
+        if (leaf == ROOT_CLASS || m_classes[leaf].tokens >= 0)
+        {
+            withinRate |= (1U << band);
+            m_bands[band].lender = leaf;
+            continue;
+        }
+
+        // look for an ancestor to borrow from, as long as the ceils allow it
+        for (uint32_t c = leaf; c != ROOT_CLASS && m_classes[c].ctokens >= 0;
+             c = m_classes[c].parent)
+        {
+            if (m_classes[c].tokens >= 0)
+            {
+                borrowing |= (1U << band);
+                m_bands[band].lender = c;
+                break;
+            }
+        }
+    }
+
+    NS_LOG_LOGIC("Bands within rate: " << withinRate << " borrowing: " << borrowing);
+
+    return withinRate ? withinRate : borrowing;
+}
+
+void
+WFQQueueDisc::ChargeBand(uint32_t band, uint32_t bytes)
+{
+    uint32_t lender = m_bands[band].lender;
+    bool borrowed = (lender != m_bandClass[band]);
+
+    // the rate of the classes below the lender is not charged: their tokens
+    // stay negative until they are refilled
+    for (uint32_t c = m_bandClass[band]; c != ROOT_CLASS; c = m_classes[c].parent)
+    {
+        if (c == lender)
+        {
+            borrowed = false;
+        }
+        if (!borrowed)
+        {
+            m_classes[c].tokens -= bytes;
+        }
+        m_classes[c].ctokens -= bytes;
+    }
+}
+
+void
+WFQQueueDisc::ScheduleWakeUp()
+{
+    if (!m_wakeEvent.IsExpired())
+    {
+        return;
+    }
+
+    double wait = std::numeric_limits<double>::infinity();
+
+    for (uint32_t mask = m_activeMask; mask; mask &= mask - 1)
+    {
+        double ceilWait = 0;
+
+        for (uint32_t c = m_bandClass[__builtin_ctz(mask)]; c != ROOT_CLASS;
+             c = m_classes[c].parent)
+        {
+            const LinkSharingClass& cl = m_classes[c];
+            double rateWait = cl.tokens < 0 ? -cl.tokens * 8 / cl.rate.GetBitRate() : 0;
+            if (cl.ctokens < 0)
+            {
+                ceilWait = std::max(ceilWait, -cl.ctokens * 8 / cl.ceil.GetBitRate());
+            }
+            wait = std::min(wait, std::max(rateWait, ceilWait));
+        }
+    }
+
+    if (std::isinf(wait))
+    {
+        // no link-sharing class constrains the non-empty bands
+        return;
+    }
+
+    Time delay = NanoSeconds(std::max<int64_t>(1, std::ceil(wait * 1e9)));
+    NS_LOG_LOGIC("All the non-empty bands are shaped, wake up in " << delay);
+    m_wakeEvent = Simulator::Schedule(delay, &QueueDisc::Run, this);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/**
+ * \brief Map 16 priorities to bands with the SSSE3 byte shuffle (pshufb).
+ * Only call it if the CPU supports SSSE3
+ * \param table the band of each priority
+ * \param prio the priorities, between 0 and 15
+ * \param bands the bands of the priorities
+ */
+__attribute__((target("ssse3"))) static void
+MapPrioritiesSsse3(const uint8_t* table, const uint8_t* prio, uint8_t* bands)
+{
+    __m128i map = _mm_load_si128(reinterpret_cast<const __m128i*>(table));
+    __m128i idx = _mm_load_si128(reinterpret_cast<const __m128i*>(prio));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(bands), _mm_shuffle_epi8(map, idx));
+}
+
+/**
+ * \brief Check whether the CPU has the SSSE3 byte shuffle instruction
+ * \return true if the CPU has the byte shuffle instruction
+ */
+static bool
+HasByteShuffle()
+{
+    static const bool supported = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("ssse3") != 0;
+    }();
+    return supported;
+}
+#endif
+
+uint32_t
+WFQQueueDisc::EnqueueBatch(const std::vector<Ptr<QueueDiscItem>>& items)
+{
+    NS_LOG_FUNCTION(this << items.size());
+
+    uint32_t enqueued = 0;
+
+    if (GetNPacketFilters() > 0)
+    {
+        // packet filters can only classify one packet at a time
+        for (const auto& item : items)
+        {
+            enqueued += Enqueue(item);
+        }
+        return enqueued;
+    }
+
+    // packets without a priority tag are mapped like priority 0 packets
+    alignas(16) uint8_t table[16];
+    alignas(16) uint8_t prio[16];
+    for (uint8_t i = 0; i < 16; i++)
+    {
+        NS_ASSERT_MSG(m_prio2band[i] < m_bands.size(), "Priomap band out of range");
+        table[i] = static_cast<uint8_t>(m_prio2band[i]);
+    }
+
+    std::size_t nItems = items.size();
+    m_batchBands.resize((nItems + 15) & ~static_cast<std::size_t>(15));
+    SocketPriorityTag priorityTag;
+
+    for (std::size_t base = 0; base < nItems; base += 16)
+    {
+        std::size_t n = std::min<std::size_t>(16, nItems - base);
+        uint8_t tos;
+        if (m_classifyByDscp)
+        {
+            // the DSCP table has 64 entries, too many for a single shuffle
+            for (std::size_t j = 0; j < n; j++)
+            {
+                m_batchBands[base + j] =
+                    items[base + j]->GetUint8Value(QueueItem::IP_DSFIELD, tos)
+                        ? m_dscp2band[tos >> 2]
+                        : table[items[base + j]->GetPacket()->PeekPacketTag(priorityTag)
+                                    ? priorityTag.GetPriority() & 0x0f
+                                    : 0];
+            }
+            continue;
+        }
+        for (std::size_t j = 0; j < 16; j++)
+        {
+            prio[j] = (j < n && items[base + j]->GetPacket()->PeekPacketTag(priorityTag))
+                          ? priorityTag.GetPriority() & 0x0f
+                          : 0;
+        }
+#if defined(__x86_64__) && defined(__GNUC__)
+        if (HasByteShuffle())
+        {
+            MapPrioritiesSsse3(table, prio, &m_batchBands[base]);
+            continue;
+        }
+#endif
+        for (std::size_t j = 0; j < 16; j++)
+        {
+            m_batchBands[base + j] = table[prio[j]];
+        }
+    }
+
+    // counting sort of the packets by band, preserving the arrival order
+    // within each band, so that each child queue disc is fed in one go
+    std::array<uint32_t, 33> first{};
+    for (std::size_t i = 0; i < nItems; i++)
+    {
+        first[m_batchBands[i] + 1]++;
+    }
+    for (uint32_t b = 0; b < m_bands.size(); b++)
+    {
+        first[b + 1] += first[b];
+    }
+    m_batchOrder.resize(nItems);
+    for (std::size_t i = 0; i < nItems; i++)
+    {
+        m_batchOrder[first[m_batchBands[i]]++] = i;
+    }
+
+    // the packets of a band are appended to its child queue disc in a row, and
+    // the state of the band is brought up to date once, after the last of them
+    for (std::size_t i = 0; i < nItems;)
+    {
+        uint32_t band = m_batchBands[m_batchOrder[i]];
+        m_batchBand = band;
+        for (; i < first[band]; i++)
+        {
+            enqueued += Enqueue(items[m_batchOrder[i]]);
+        }
+        m_batchBand = NO_BAND;
+        m_peekedBand = NO_BAND;
+        SyncBand(band);
+        ActivateBand(band);
+    }
+
+    NS_LOG_LOGIC("Enqueued " << enqueued << " packets out of " << nItems);
+    return enqueued;
+}
+
+bool
+WFQQueueDisc::DoEnqueue(Ptr<QueueDiscItem> item)
+{
+    NS_LOG_FUNCTION(this << item);
+
+    uint32_t band = m_prio2band[0];
+    int32_t ret;
+    // EnqueueBatch updates the state of the band after the last packet of a run
+    bool inBatch = (m_batchBand != NO_BAND);
+
+    if (inBatch)
+    {
+        NS_LOG_DEBUG("Band selected by EnqueueBatch: " << m_batchBand);
+        band = m_batchBand;
+    }
+    else if ((ret = Classify(item)) == PacketFilter::PF_NO_MATCH)
+    {
+        uint8_t tos;
+        if (m_classifyByDscp && item->GetUint8Value(QueueItem::IP_DSFIELD, tos))
+        {
+            NS_LOG_DEBUG("No filter has been able to classify this packet, using DSCP.");
+            band = m_dscp2band[tos >> 2];
+        }
+        else
+        {
+            NS_LOG_DEBUG("No filter has been able to classify this packet, using priomap.");
+
+            SocketPriorityTag priorityTag;
+            if (item->GetPacket()->PeekPacketTag(priorityTag))
+            {
+                band = m_prio2band[priorityTag.GetPriority() & 0x0f];
+            }
+        }
+    }
+    else
+    {
+        NS_LOG_DEBUG("Packet filters returned " << ret);
+
+        if (ret >= 0 && static_cast<uint32_t>(ret) < m_bands.size())
+        {
+            band = ret;
+        }
+    }
+
+    NS_ASSERT_MSG(band < m_bands.size(), "Selected band out of range");
+
+    if (m_sharedBuffer && !AdmitToSharedBuffer(item, band))
+    {
+        DropBeforeEnqueue(item, SHARED_BUFFER_DROP);
+        return false;
+    }
+
+    BandState& state = m_bands[band];
+    uint32_t size = item->GetSize();
+    item->SetTimeStamp(Simulator::Now());
+    bool retval = state.qd->Enqueue(item);
+
+    // If Queue::Enqueue fails, QueueDisc::Drop is called by the child queue disc
+    // because QueueDisc::AddQueueDiscClass sets the drop callback
+
+    if (!inBatch)
+    {
+        // the arriving packet may precede the one found by the last peek
+        m_peekedBand = NO_BAND;
+        SyncBand(band);
+    }
+
+    if (!retval)
+    {
+        return retval;
+    }
+
+    m_traceBandEnqueue(item, band);
+
+    if (m_scheduler == WFQ || m_scheduler == WF2Q_PLUS || m_scheduler == BUCKETED_WFQ)
+    {
+        VirtualTime start = VirtualTimeMax(m_virtualTime, state.lastFinish);
+        state.lastFinish = start + size * state.invWeight;
+        state.tags.push_back({start, state.lastFinish});
+
+        NS_LOG_LOGIC("Tags of the packet enqueued in band " << band << ": start " << start
+                                                            << " finish " << state.lastFinish);
+    }
+
+    if (!inBatch)
+    {
+        ActivateBand(band);
+    }
+
+    NS_LOG_LOGIC("Number packets band " << band << ": " << state.qd->GetNPackets());
+
+    return retval;
+}
+
+void
+WFQQueueDisc::ActivateBand(uint32_t band)
+{
+    BandState& state = m_bands[band];
+
+    if (m_scheduler == WFQ || m_scheduler == WF2Q_PLUS || m_scheduler == BUCKETED_WFQ)
+    {
+        PushBand(band);
+    }
+    else if (m_scheduler == DRR && !state.active && (m_activeMask & (1U << band)))
+    {
+        NS_LOG_DEBUG("Band " << band << " becomes active");
+        state.active = true;
+        state.deficit = m_quantum * m_weights[band];
+        m_activeBands.push_back(band);
+    }
+}
+
+bool
+WFQQueueDisc::AdmitToSharedBuffer(Ptr<const QueueDiscItem> item, uint32_t band)
+{
+    NS_LOG_FUNCTION(this << item << band);
+
+    bool bytes = (GetMaxSize().GetUnit() == QueueSizeUnit::BYTES);
+    uint32_t limit = GetMaxSize().GetValue();
+    uint32_t size = (bytes ? item->GetSize() : 1);
+    Ptr<QueueDisc> qd = m_bands[band].qd;
+    // the bands with a lower priority than the selected one
+    uint32_t lower = ~((2U << band) - 1);
+    // whether packets have been pushed out to make room for the packet
+    bool pushed = false;
+
+    while (true)
+    {
+        uint32_t used = (bytes ? GetNBytes() : GetNPackets());
+        uint32_t free = (used < limit ? limit - used : 0);
+        uint32_t backlog = (bytes ? qd->GetNBytes() : qd->GetNPackets());
+
+        if (size <= free)
+        {
+            // the threshold applies unless the buffer was full, as it is zero then
+            if (pushed || backlog < m_dtAlpha * free)
+            {
+                return true;
+            }
+            NS_LOG_LOGIC("Band " << band << " over its threshold: backlog " << backlog
+                                 << ", free space " << free);
+            return false;
+        }
+
+        uint32_t victims = m_activeMask & lower;
+        if (!m_pushOut || !victims)
+        {
+            NS_LOG_LOGIC("Shared buffer full, free space " << free);
+            return false;
+        }
+
+        // there is no way to remove a packet from the tail of a queue disc, hence
+        // the head packet of the lowest priority band is pushed out
+        uint32_t victim = 31 - __builtin_clz(victims);
+        Ptr<QueueDiscItem> victimItem = m_bands[victim].qd->Dequeue();
+        m_peekedBand = NO_BAND;
+        SyncBand(victim);
+
+        if (victimItem)
+        {
+            NS_LOG_LOGIC("Pushed out of band " << victim << ": " << victimItem);
+            DropAfterDequeue(victimItem, PUSH_OUT_DROP);
+            pushed = true;
+        }
+    }
+}
+
+Ptr<QueueDiscItem>
+WFQQueueDisc::DoDequeue()
+{
+    NS_LOG_FUNCTION(this);
+
+    Ptr<QueueDiscItem> item;
+    uint32_t band;
+    uint32_t allowed = UINT32_MAX;
+
+    if (!m_classes.empty() && m_activeMask && !(allowed = GetSendableBands()))
+    {
+        ScheduleWakeUp();
+        return item;
+    }
+
+    while (SelectBand(band, allowed))
+    {
+        m_peekedBand = NO_BAND;
+        BandState& state = m_bands[band];
+        bool tagged =
+            (m_scheduler == WFQ || m_scheduler == WF2Q_PLUS || m_scheduler == BUCKETED_WFQ);
+        VirtualTime finish = 0;
+
+        if (tagged)
+        {
+            PopBand(band);
+        }
+
+        item = state.qd->Dequeue();
+
+        if (item && tagged)
+        {
+            // the child queue disc may have dropped packets from the head of its
+            // queue before returning this one, whose tag follows theirs
+            std::size_t removed = state.tags.size() - state.qd->GetNPackets();
+            NS_ASSERT_MSG(removed > 0, "No tag for the packet dequeued from band " << band);
+            finish = state.tags[removed - 1].finish;
+        }
+        SyncBand(band);
+
+        if (item)
+        {
+            if (m_scheduler == WFQ || m_scheduler == BUCKETED_WFQ)
+            {
+                m_virtualTime = finish;
+            }
+            else if (m_scheduler == WF2Q_PLUS)
+            {
+                m_virtualTime += item->GetSize() * m_invWeightSum;
+            }
+            else if (m_scheduler == DRR)
+            {
+                state.deficit -= item->GetSize();
+            }
+
+            if (!m_classes.empty())
+            {
+                ChargeBand(band, item->GetSize());
+            }
+        }
+
+        // reinsert the band, now that its head and the virtual time are updated
+        if (tagged)
+        {
+            PushBand(band);
+        }
+
+        if (item)
+        {
+            Time sojourn = Simulator::Now() - item->GetTimeStamp();
+            m_sojourn[band][GetSojournBucket(sojourn.GetNanoSeconds())]++;
+            m_traceBandDequeue(item, band);
+
+            NS_LOG_LOGIC("Popped from band " << band << ": " << item);
+            NS_LOG_LOGIC("Number packets band " << band << ": " << state.qd->GetNPackets());
+            return item;
+        }
+    }
+
+    if (m_activeMask)
+    {
+        // the non-empty bands are all shaped out
+        ScheduleWakeUp();
+    }
+
+    NS_LOG_LOGIC("Queue empty");
+    return item;
+}
+
+Ptr<const QueueDiscItem>
+WFQQueueDisc::DoPeek()
+{
+    NS_LOG_FUNCTION(this);
+
+    Ptr<const QueueDiscItem> item;
+    uint32_t band;
+    uint32_t allowed = UINT32_MAX;
+
+    if (!m_classes.empty() && m_activeMask && !(allowed = GetSendableBands()))
+    {
+        ScheduleWakeUp();
+        return item;
+    }
+
+    // the DRR rotations performed here are the same DoDequeue would perform
+    while (SelectBand(band, allowed))
+    {
+        if ((item = m_bands[band].qd->Peek()))
+        {
+            NS_LOG_LOGIC("Peeked from band " << band << ": " << item);
+            NS_LOG_LOGIC("Number packets band " << band << ": "
+                                                << m_bands[band].qd->GetNPackets());
+            // the bands allowed by the link-sharing classes depend on the time
+            m_peekedBand = m_classes.empty() ? band : NO_BAND;
+            return item;
+        }
+
+        // the child queue disc dropped all of its packets
+        m_peekedBand = NO_BAND;
+        SyncBand(band);
+    }
+
+    if (m_activeMask)
+    {
+        // the non-empty bands are all shaped out
+        ScheduleWakeUp();
+    }
+
+    NS_LOG_LOGIC("Queue empty");
+    return item;
+}
+
+bool
+WFQQueueDisc::CheckConfig()
+{
+    NS_LOG_FUNCTION(this);
+    if (GetNInternalQueues() > 0)
+    {
+        NS_LOG_ERROR("WFQQueueDisc cannot have internal queues");
+        return false;
+    }
+
+    if (GetNQueueDiscClasses() > 0 && !m_childAttrs.empty())
+    {
+        NS_LOG_ERROR("Child queue disc attributes set, but the classes are already configured");
+        return false;
+    }
+
+    for (const auto& attr : m_childAttrs)
+    {
+        if (attr.band != ALL_BANDS && attr.band >= m_defaultBands)
+        {
+            NS_LOG_ERROR("Attribute " << attr.name << " set for the non-existent band "
+                                      << attr.band);
+            return false;
+        }
+    }
+
+    if (GetNQueueDiscClasses() == 0)
+    {
+        // create m_defaultBands child queue discs of the configured type, all
+        // from the same prototype plus the attributes set for their band
+        ObjectFactory prototype;
+        prototype.SetTypeId(m_childType);
+        for (const auto& attr : m_childAttrs)
+        {
+            if (attr.band == ALL_BANDS)
+            {
+                prototype.Set(attr.name, *attr.value);
+            }
+        }
+        for (uint32_t i = 0; i < m_defaultBands; i++)
+        {
+            ObjectFactory factory = prototype;
+            for (const auto& attr : m_childAttrs)
+            {
+                if (attr.band == i)
+                {
+                    factory.Set(attr.name, *attr.value);
+                }
+            }
+            Ptr<QueueDisc> qd = factory.Create<QueueDisc>();
+            qd->Initialize();
+            Ptr<QueueDiscClass> c = CreateObject<QueueDiscClass>();
+            c->SetQueueDisc(qd);
+            AddQueueDiscClass(c);
+        }
+    }
+
+    if (GetNQueueDiscClasses() < 2)
+    {
+        NS_LOG_ERROR("WFQQueueDisc needs at least 2 classes");
+        return false;
+    }
+
+    if (GetNQueueDiscClasses() > 32)
+    {
+        NS_LOG_ERROR("WFQQueueDisc cannot have more than 32 classes");
+        return false;
+    }
+
+    for (uint32_t i = GetNQueueDiscClasses(); i < m_bandClass.size(); i++)
+    {
+        if (m_bandClass[i] != ROOT_CLASS)
+        {
+            NS_LOG_ERROR("Link-sharing class set for the non-existent band " << i);
+            return false;
+        }
+    }
+
+    if (m_classifyByDscp)
+    {
+        for (uint8_t dscp = 0; dscp < 64; dscp++)
+        {
+            if (m_dscp2band[dscp] != DSCP_UNSET && m_dscp2band[dscp] >= GetNQueueDiscClasses())
+            {
+                NS_LOG_ERROR("DSCP " << +dscp << " mapped to the non-existent band "
+                                     << +m_dscp2band[dscp]);
+                return false;
+            }
+        }
+    }
+
+    for (uint32_t i = GetNQueueDiscClasses(); i < m_guarantee.size(); i++)
+    {
+        if (m_guarantee[i].constrained)
+        {
+            NS_LOG_ERROR("Arrival curve set for the non-existent band " << i);
+            return false;
+        }
+    }
+
+    if (m_scheduler != STRICT_PRIORITY)
+    {
+        if (GetNQueueDiscClasses() > m_weights.size())
+        {
+            NS_LOG_ERROR("WFQQueueDisc cannot weight more than " << m_weights.size()
+                                                                 << " classes");
+            return false;
+        }
+
+        for (uint32_t i = 0; i < GetNQueueDiscClasses(); i++)
+        {
+            if (m_weights[i] == 0)
+            {
+                NS_LOG_ERROR("The weight of band " << i << " cannot be null");
+                return false;
+            }
+        }
+    }
+
+    if (m_scheduler == BUCKETED_WFQ &&
+        ((m_rankBuckets & (m_rankBuckets - 1)) || (m_rankGranularity & (m_rankGranularity - 1))))
+    {
+        NS_LOG_ERROR("The number of buckets and their granularity must be powers of two");
+        return false;
+    }
+
+    // we are at initialization time. If the user has not set a quantum value,
+    // set the quantum to the MTU of the device (if any)
+    if (m_scheduler == DRR && !m_quantum)
+    {
+        Ptr<NetDeviceQueueInterface> ndqi = GetNetDeviceQueueInterface();
+        Ptr<NetDevice> dev;
+        // if the NetDeviceQueueInterface object is aggregated to a
+        // NetDevice, get the MTU of such NetDevice
+        if (ndqi && (dev = ndqi->GetObject<NetDevice>()))
+        {
+            m_quantum = dev->GetMtu();
+            NS_LOG_DEBUG("Setting the quantum to the MTU of the device: " << m_quantum);
+        }
+
+        if (!m_quantum)
+        {
+            NS_LOG_ERROR("The quantum parameter cannot be null");
+            return false;
+        }
+    }
+
+    if (!CheckGuarantees())
+    {
+        NS_LOG_ERROR("The delay guaranteed to some band cannot be met");
+        return false;
+    }
+
+    return true;
+}
+
+void
+WFQQueueDisc::InitializeParams()
+{
+    NS_LOG_FUNCTION(this);
+
+    m_virtualTime = 0;
+    m_activeMask = 0;
+    m_peekedBand = NO_BAND;
+    m_bands.assign(GetNQueueDiscClasses(), BandState());
+    for (uint32_t i = 0; i < m_bands.size(); i++)
+    {
+        m_bands[i].qd = GetQueueDiscClass(i)->GetQueueDisc();
+    }
+    m_heap.clear();
+    m_heap.reserve(GetNQueueDiscClasses());
+    m_startHeap.clear();
+    m_startHeap.reserve(GetNQueueDiscClasses());
+    m_parked.reserve(GetNQueueDiscClasses());
+    m_lastRefill = Simulator::Now();
+    for (auto& c : m_classes)
+    {
+        c.tokens = m_burst;
+        c.ctokens = m_burst;
+    }
+    m_invWeightSum = 0;
+    if (m_scheduler != STRICT_PRIORITY)
+    {
+        // pre-invert the weights, so that computing the tags takes no division
+        const VirtualTime one = VirtualTime(1) << VT_FRAC_BITS;
+        uint64_t weightSum = 0;
+        for (uint32_t i = 0; i < m_bands.size(); i++)
+        {
+            m_bands[i].invWeight = (one + m_weights[i] / 2) / m_weights[i];
+            weightSum += m_weights[i];
+        }
+        m_invWeightSum = (one + weightSum / 2) / weightSum;
+    }
+    m_activeBands.clear();
+    m_sojourn.assign(m_bands.size(), SojournHistogram{});
+    if (m_scheduler == BUCKETED_WFQ)
+    {
+        // finish tags are in fixed point, custom ranks are used as they are
+        uint32_t shift = (m_rankFunction.IsNull() ? VT_FRAC_BITS : 0);
+        m_rankQueue.Init(m_bands.size(), m_rankBuckets, shift + __builtin_ctz(m_rankGranularity));
+    }
+    // DSCPs without an explicit band follow the priomap, through the same
+    // DSCP to priority mapping used by sockets to set the priority tag
+    for (uint8_t dscp = 0; dscp < 64; dscp++)
+    {
+        if (m_dscp2band[dscp] == DSCP_UNSET)
+        {
+            m_dscp2band[dscp] = m_prio2band[Socket::IpTos2Priority(dscp << 2) & 0x0f];
+        }
+    }
 }
 
 } // namespace ns3
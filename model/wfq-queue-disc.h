@@ -20,9 +20,19 @@
 #ifndef WFQ_QUEUE_DISC_H
 #define WFQ_QUEUE_DISC_H
 
+#include "bucket-queue.h"
 #include "queue-disc.h"
 
+#include "ns3/callback.h"
+#include "ns3/data-rate.h"
+#include "ns3/event-id.h"
+#include "ns3/nstime.h"
+#include "ns3/traced-callback.h"
+
 #include <array>
+#include <deque>
+#include <string>
+#include <vector>
 
 namespace ns3
 {
@@ -30,6 +40,9 @@ namespace ns3
 /// Priority map
 typedef std::array<uint16_t, 16> WFQmap;
 
+/// Band weights
+typedef std::array<uint32_t, 16> WFQweights;
+
 class WFQQueueDisc : public QueueDisc
 {
   public:
@@ -45,6 +58,18 @@ class WFQQueueDisc : public QueueDisc
 
     ~WFQQueueDisc() override;
 
+    /**
+     * \brief Scheduling discipline used to serve the bands
+     */
+    enum SchedulerType
+    {
+        STRICT_PRIORITY, //!< Always serve the lowest-numbered non-empty band
+        WFQ,             //!< Serve the packet with the smallest virtual finish tag
+        DRR,             //!< Deficit round robin, with per-band quanta proportional to weights
+        WF2Q_PLUS,       //!< Serve the eligible packet with the smallest virtual finish tag
+        BUCKETED_WFQ,    //!< Bands ranked in buckets by head finish tag or by a rank function
+    };
+
     /**
      * Set the band (class) assigned to packets with specified priority.
      *
@@ -61,6 +86,219 @@ class WFQQueueDisc : public QueueDisc
      */
     uint16_t GetBandForWFQrity(uint8_t prio) const;
 
+    /**
+     * Set the band (class) assigned to packets with specified DSCP, when the
+     * ClassifyByDscp attribute is set. DSCPs without an explicit band are
+     * mapped to a priority as sockets do, and then through the priomap.
+     *
+     * \param dscp the DSCP of packets (a value between 0 and 63).
+     * \param band the band assigned to packets.
+     */
+    void SetBandForDscp(uint8_t dscp, uint16_t band);
+
+    /**
+     * Get the band (class) assigned to packets with specified DSCP.
+     *
+     * \param dscp the DSCP of packets (a value between 0 and 63).
+     * \returns the band assigned to packets.
+     */
+    uint16_t GetBandForDscp(uint8_t dscp) const;
+
+    /**
+     * Set the weight of the specified band.
+     *
+     * \param band the band (a value between 0 and 15).
+     * \param weight the weight of the band.
+     */
+    void SetBandWeight(uint16_t band, uint32_t weight);
+
+    /**
+     * Get the weight of the specified band.
+     *
+     * \param band the band (a value between 0 and 15).
+     * \returns the weight of the band.
+     */
+    uint32_t GetBandWeight(uint16_t band) const;
+
+    /**
+     * \brief Set the quantum value.
+     *
+     * \param quantum The number of bytes a band of unit weight gets to dequeue on each
+     * round of the deficit round robin scheduler
+     */
+    void SetQuantum(uint32_t quantum);
+
+    /**
+     * \brief Get the quantum value.
+     *
+     * \returns The number of bytes a band of unit weight gets to dequeue on each
+     * round of the deficit round robin scheduler
+     */
+    uint32_t GetQuantum() const;
+
+    /**
+     * Callback signature for the rank of a band. The bands are served in
+     * increasing order of rank, e.g., of the deadline of their head packet for
+     * earliest deadline first.
+     *
+     * \param [in] band The band.
+     * \param [in] item The head packet of the band.
+     * \returns The rank of the band.
+     */
+    typedef Callback<uint64_t, uint32_t, Ptr<const QueueDiscItem>> RankCallback;
+
+    /**
+     * \brief Set the function ranking the bands in BucketedWFQ mode, instead of
+     * the finish tag of their head packet. Ranks may wrap around, as they are
+     * only compared through the sign of their difference, and each bucket
+     * covers RankGranularity ranks. This must be called before the queue disc
+     * is initialized.
+     *
+     * \param rank the rank function
+     */
+    void SetRankFunction(RankCallback rank);
+
+    /**
+     * \brief Get the sojourn time histograms of all the bands, as lines of
+     * "band lowerBound upperBound count", in nanoseconds, for the non-empty buckets.
+     *
+     * \returns the sojourn time histograms.
+     */
+    std::string GetSojournHistograms() const;
+
+    /**
+     * \brief Get a percentile of the sojourn time of the packets dequeued from
+     * a band, with the relative precision of the histogram buckets.
+     *
+     * \param band the band.
+     * \param percentile the percentile (a value between 0 and 100).
+     * \returns the upper bound of the bucket holding the percentile (zero if no
+     * packet has been dequeued from the band).
+     */
+    Time GetSojournPercentile(uint32_t band, double percentile) const;
+
+    /**
+     * TracedCallback signature for the enqueue and dequeue of a packet in a band.
+     *
+     * \param [in] item The packet.
+     * \param [in] band The band.
+     */
+    typedef void (*BandTracedCallback)(Ptr<const QueueDiscItem> item, uint32_t band);
+
+    /**
+     * Enqueue a burst of packets. The priority of all the packets is mapped to
+     * a band at once, through the priomap, and then the packets are enqueued
+     * band by band, in their arrival order within each band; the scheduling
+     * state of a band is updated once, after its last packet. This is otherwise
+     * equivalent to calling Enqueue for each packet. If packet filters are
+     * installed, the packets are classified one at a time.
+     *
+     * \param items the packets.
+     * \returns the number of packets enqueued.
+     */
+    uint32_t EnqueueBatch(const std::vector<Ptr<QueueDiscItem>>& items);
+
+    static constexpr uint32_t ROOT_CLASS = UINT32_MAX; //!< Parent of the top level classes
+
+    /**
+     * Add an interior link-sharing class. Packets are never queued in interior
+     * classes; they only bound the rate of their descendants and lend them the
+     * capacity their other descendants leave idle.
+     *
+     * \param parent the parent class (ROOT_CLASS for a top level class).
+     * \param rate the rate guaranteed to the class.
+     * \param ceil the maximum rate of the class, including borrowed capacity.
+     * \returns the identifier of the class.
+     */
+    uint32_t AddLinkSharingClass(uint32_t parent, DataRate rate, DataRate ceil);
+
+    /**
+     * Make the specified band a leaf link-sharing class. Bands that are not
+     * made link-sharing classes are never shaped.
+     *
+     * \param band the band.
+     * \param parent the parent class (ROOT_CLASS for a top level class).
+     * \param rate the rate guaranteed to the band.
+     * \param ceil the maximum rate of the band, including borrowed capacity.
+     * \returns the identifier of the class.
+     */
+    uint32_t SetBandLinkSharing(uint16_t band, uint32_t parent, DataRate rate, DataRate ceil);
+
+    /**
+     * Set an attribute of the child queue discs created by default, i.e., when
+     * no class is configured. The child queue discs are of the type given by the
+     * ChildQueueDiscType attribute.
+     *
+     * \param name the name of the attribute.
+     * \param value the value of the attribute.
+     */
+    void SetChildQueueDiscAttribute(std::string name, const AttributeValue& value);
+
+    /**
+     * Set an attribute of the child queue disc created by default for the
+     * specified band. This overrides the value set for all the bands.
+     *
+     * \param band the band.
+     * \param name the name of the attribute.
+     * \param value the value of the attribute.
+     */
+    void SetChildQueueDiscAttribute(uint16_t band, std::string name, const AttributeValue& value);
+
+    /**
+     * Declare the token bucket arrival curve of the traffic of a band, which
+     * the delay and backlog bounds of the band rely on.
+     *
+     * \param band the band.
+     * \param burst the bucket depth in bytes.
+     * \param rate the token rate.
+     */
+    void SetBandArrivalCurve(uint16_t band, uint32_t burst, DataRate rate);
+
+    /**
+     * Get the worst-case queuing delay of the packets of a band, given the
+     * arrival curve of the band (and of the higher priority bands, in strict
+     * priority mode), the LinkRate and the rate-latency service curve the
+     * scheduler guarantees to the band. Link-sharing is not taken into account.
+     *
+     * \param band the band.
+     * \returns the delay bound (Time::Max () if the delay is unbounded).
+     */
+    Time GetBandDelayBound(uint16_t band) const;
+
+    /**
+     * Get the worst-case backlog of a band, under the same assumptions as
+     * GetBandDelayBound.
+     *
+     * \param band the band.
+     * \returns the backlog bound in bytes (UINT32_MAX if the backlog is unbounded).
+     */
+    uint32_t GetBandBacklogBound(uint16_t band) const;
+
+    /**
+     * Reserve a delay guarantee for the traffic of a band, if the guarantee can
+     * be met without breaking the guarantees reserved for the other bands. The
+     * configuration is rejected by CheckConfig if a guarantee cannot be met.
+     *
+     * \param band the band.
+     * \param burst the bucket depth in bytes of the arrival curve of the band.
+     * \param rate the token rate of the arrival curve of the band.
+     * \param delay the delay to guarantee.
+     * \returns true if the reservation has been accepted.
+     */
+    bool ReserveBand(uint16_t band, uint32_t burst, DataRate rate, Time delay);
+
+    // Reasons for dropping packets
+    static constexpr const char* SHARED_BUFFER_DROP =
+        "Shared buffer drop"; //!< Band over its share of the buffer, or buffer full
+    static constexpr const char* PUSH_OUT_DROP =
+        "Push-out drop"; //!< Packet pushed out by a higher priority packet
+
+  protected:
+    /**
+     * \brief Dispose of the object
+     */
+    void DoDispose() override;
+
   private:
     bool DoEnqueue(Ptr<QueueDiscItem> item) override;
     Ptr<QueueDiscItem> DoDequeue() override;
@@ -68,7 +306,270 @@ class WFQQueueDisc : public QueueDisc
     bool CheckConfig() override;
     void InitializeParams() override;
 
-    WFQmap m_prio2band; //!< Priority to band mapping
+    /**
+     * \brief Virtual time, in bytes per unit weight, in fixed point with
+     * VT_FRAC_BITS fractional bits. Virtual times wrap around, hence they
+     * must only be compared through the sign of their difference
+     */
+    typedef uint64_t VirtualTime;
+
+    static constexpr uint32_t VT_FRAC_BITS = 32; //!< Fractional bits of the virtual times
+
+    /**
+     * \brief Virtual start and finish tags of a packet
+     */
+    struct VirtualTags
+    {
+        VirtualTime start;  //!< Virtual start tag
+        VirtualTime finish; //!< Virtual finish tag
+    };
+
+    /**
+     * \brief Scheduling state of a band
+     */
+    struct BandState
+    {
+        Ptr<QueueDisc> qd;            //!< Child queue disc of the band
+        std::deque<VirtualTags> tags; //!< Virtual tags of the queued packets
+        VirtualTime lastFinish{0};    //!< Finish tag of the last packet enqueued
+        VirtualTime invWeight{0};     //!< Virtual time per byte, i.e., inverse of the weight
+        bool inHeap{false};           //!< True if the band has an entry in the heap
+        int32_t deficit{0};           //!< Deficit of the band (DRR)
+        bool active{false};           //!< True if the band is in the active list (DRR)
+        uint32_t lender{ROOT_CLASS};  //!< Class whose tokens the band is using
+    };
+
+    /**
+     * \brief Update the active band bitmap after the child queue disc of the
+     * given band has been accessed, and discard the finish tags of the packets
+     * it dropped, so that the tags match the queued packets
+     * \param band the band
+     */
+    void SyncBand(uint32_t band);
+
+    /**
+     * \brief Make a band that has packets eligible for service: insert it in
+     * the heap (or bucket queue) of its scheduler, or in the DRR active list
+     * \param band the band
+     */
+    void ActivateBand(uint32_t band);
+
+    /**
+     * \brief Insert the given band in the heap, keyed on its head finish tag.
+     * With WF2Q+, a band whose head is not eligible yet is inserted in the
+     * start heap instead, keyed on its head start tag. In BucketedWFQ mode, the
+     * band is inserted in the bucket queue, keyed on its rank
+     * \param band the band
+     */
+    void PushBand(uint32_t band);
+
+    /**
+     * \brief Remove the entry of the given band from the heap
+     * \param band the band
+     */
+    void PopBand(uint32_t band);
+
+    /**
+     * \brief Get the allowed band holding the packet with the smallest finish
+     * tag, discarding the stale entries found at the top of the heap
+     * \param band the band holding the packet with the smallest finish tag
+     * \param allowed the bitmap of the bands that can be served
+     * \return false if no allowed band is in the heap
+     */
+    bool GetHeadBand(uint32_t& band, uint32_t allowed);
+
+    /**
+     * \brief Get the allowed band holding the eligible packet with the smallest
+     * finish tag (WF2Q+). The bands whose head became eligible are moved from
+     * the start heap to the heap and, if no packet is eligible, the virtual time
+     * is advanced to the smallest start tag
+     * \param band the band holding the eligible packet with the smallest finish tag
+     * \param allowed the bitmap of the bands that can be served
+     * \return false if no allowed band can be served
+     */
+    bool GetEligibleBand(uint32_t& band, uint32_t allowed);
+
+    /**
+     * \brief Get the allowed band to be served by the deficit round robin
+     * scheduler, refilling the deficit of the bands that exhausted it and
+     * removing the bands that became empty from the active list
+     * \param band the band to be served
+     * \param allowed the bitmap of the bands that can be served
+     * \return false if no allowed band can be served
+     */
+    bool GetDrrBand(uint32_t& band, uint32_t allowed);
+
+    /**
+     * \brief Get the allowed band with the smallest rank, as ranked by the
+     * bucket queue
+     * \param band the band to be served
+     * \param allowed the bitmap of the bands that can be served
+     * \return false if no allowed band can be served
+     */
+    bool GetRankedBand(uint32_t& band, uint32_t allowed);
+
+    /**
+     * \brief Get the band to be served next, according to the configured
+     * scheduler, or the band found by the last peek if nothing changed since
+     * \param band the band to be served
+     * \param allowed the bitmap of the bands that can be served
+     * \return false if no allowed band can be served
+     */
+    bool SelectBand(uint32_t& band, uint32_t allowed);
+
+    /**
+     * \brief Refill the token buckets of the link-sharing classes and compute
+     * the non-empty bands that can be served: the bands within their rate if
+     * any, otherwise the bands that can borrow from an ancestor within their
+     * ceil and the ceil of the classes in between. Bands that are not
+     * link-sharing classes can always be served.
+     * \return the bitmap of the bands that can be served
+     */
+    uint32_t GetSendableBands();
+
+    /**
+     * \brief Charge the transmission of a packet to the link-sharing classes
+     * the given band belongs to
+     * \param band the band
+     * \param bytes the size of the packet
+     */
+    void ChargeBand(uint32_t band, uint32_t bytes);
+
+    /**
+     * \brief Schedule the single timer that restarts the transmissions when
+     * the first shaped band can be served again
+     */
+    void ScheduleWakeUp();
+
+    static constexpr uint32_t HIST_SUB_BITS = 4;  //!< Bits of the buckets within a power of two
+    static constexpr uint32_t HIST_MAX_BITS = 40; //!< Bits of the largest sojourn time (ns)
+    /// Number of buckets of a histogram
+    static constexpr uint32_t HIST_BUCKETS = (HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS;
+
+    /// Log-linear histogram of the sojourn times, in nanoseconds
+    typedef std::array<uint32_t, HIST_BUCKETS> SojournHistogram;
+
+    /**
+     * \brief Get the histogram bucket of a sojourn time. Times below
+     * 2^HIST_SUB_BITS have a bucket each; every larger power of two is split
+     * into 2^HIST_SUB_BITS buckets
+     * \param ns the sojourn time in nanoseconds
+     * \return the bucket
+     */
+    static uint32_t GetSojournBucket(uint64_t ns);
+
+    /**
+     * \brief Get the smallest sojourn time of a histogram bucket
+     * \param bucket the bucket
+     * \return the smallest sojourn time in nanoseconds
+     */
+    static uint64_t GetBucketLowerBound(uint32_t bucket);
+
+    /**
+     * \brief Get the rate-latency service curve the scheduler guarantees to a band
+     * \param band the band
+     * \param rate the guaranteed rate in bytes per second
+     * \param latency the latency in seconds
+     * \return false if no service can be guaranteed to the band
+     */
+    bool GetServiceCurve(uint32_t band, double& rate, double& latency) const;
+
+    /**
+     * \brief Check that the delay guarantees reserved for the bands are met
+     * \return true if all the guarantees are met
+     */
+    bool CheckGuarantees() const;
+
+    /**
+     * \brief Check whether a packet can be admitted into the shared buffer.
+     * A band may only hold up to alpha times the free space of the buffer. If
+     * the buffer is full, i.e., the packet does not fit, packets are pushed out
+     * of the lower priority (higher numbered) bands, if enabled, until it does
+     * \param item the arriving packet
+     * \param band the band selected for the packet
+     * \return true if the packet can be enqueued
+     */
+    bool AdmitToSharedBuffer(Ptr<const QueueDiscItem> item, uint32_t band);
+
+    static constexpr uint32_t NO_BAND = UINT32_MAX;  //!< No band found by the last peek
+    static constexpr uint8_t DSCP_UNSET = UINT8_MAX; //!< DSCP without an explicit band
+
+    /**
+     * \brief Token buckets of a link-sharing class
+     */
+    struct LinkSharingClass
+    {
+        uint32_t parent; //!< Parent class
+        DataRate rate;   //!< Guaranteed rate
+        DataRate ceil;   //!< Maximum rate
+        double tokens;   //!< Bytes that can be sent within the rate (may be negative)
+        double ctokens;  //!< Bytes that can be sent within the ceil (may be negative)
+    };
+
+    /// Heap entry: virtual tag of the head packet and band
+    typedef std::pair<VirtualTime, uint32_t> HeapEntry;
+
+    static constexpr uint16_t ALL_BANDS = UINT16_MAX; //!< Attribute set for all the bands
+
+    /// Attribute of the child queue discs created by default
+    struct ChildAttr
+    {
+        uint16_t band;             //!< Band of the child queue disc (ALL_BANDS for all)
+        std::string name;          //!< Name of the attribute
+        Ptr<AttributeValue> value; //!< Value of the attribute
+    };
+
+    /// Arrival curve and delay guarantee of a band
+    struct BandGuarantee
+    {
+        bool constrained{false}; //!< True if the arrival curve is known
+        uint32_t burst{0};       //!< Bucket depth of the arrival curve in bytes
+        DataRate rate;           //!< Token rate of the arrival curve
+        Time delay{Time::Max()}; //!< Delay guaranteed to the band
+    };
+
+    WFQmap m_prio2band;                      //!< Priority to band mapping
+    bool m_classifyByDscp;                   //!< Classify packets by DSCP
+    std::array<uint8_t, 64> m_dscp2band;     //!< DSCP to band mapping
+    WFQweights m_weights;                    //!< Band weights
+    SchedulerType m_scheduler;               //!< Scheduling discipline
+    VirtualTime m_virtualTime;               //!< System virtual time
+    std::vector<BandState> m_bands;          //!< Scheduling state of the bands
+    uint32_t m_defaultBands;                 //!< Number of bands created by default
+    TypeId m_childType;                      //!< Type of the child queue discs created by default
+    std::vector<ChildAttr> m_childAttrs;     //!< Attributes of the default child queue discs
+    std::vector<HeapEntry> m_heap;           //!< Min-heap of the (eligible) head finish tags
+    std::vector<HeapEntry> m_startHeap;      //!< Min-heap of the ineligible head start tags
+    VirtualTime m_invWeightSum;              //!< Inverse of the sum of the weights of the bands
+    uint32_t m_quantum;                      //!< Deficit of the bands of unit weight per round
+    std::deque<uint32_t> m_activeBands;      //!< Round robin list of the backlogged bands (DRR)
+    uint32_t m_activeMask;                   //!< Bitmap of the non-empty bands
+    uint32_t m_peekedBand;                   //!< Band found by the last peek, if still valid
+    std::vector<HeapEntry> m_parked;         //!< Heap entries of the bands shaped out
+    std::vector<LinkSharingClass> m_classes; //!< Link-sharing classes
+    std::vector<uint32_t> m_bandClass;       //!< Link-sharing class of each band
+    uint32_t m_burst;                        //!< Depth of the token buckets in bytes
+    Time m_lastRefill;                       //!< Last time the token buckets were refilled
+    EventId m_wakeEvent;                     //!< Event restarting the transmissions
+    bool m_sharedBuffer;                     //!< Whether the bands share a buffer of MaxSize
+    double m_dtAlpha;                        //!< Dynamic threshold multiplier of the free space
+    bool m_pushOut;                          //!< Whether to push out lower priority packets
+    std::vector<SojournHistogram> m_sojourn; //!< Sojourn time histogram of each band
+    DataRate m_linkRate;                     //!< Rate of the link served by the queue disc
+    uint32_t m_maxPacketSize;                //!< Size of the largest packet in bytes
+    std::vector<BandGuarantee> m_guarantee;  //!< Arrival curve and delay guarantee of each band
+    BucketQueue m_rankQueue;                 //!< Bands ranked in buckets (BUCKETED_WFQ)
+    RankCallback m_rankFunction;             //!< Rank of the bands, if not their head finish tag
+    uint32_t m_rankBuckets;                  //!< Number of buckets of the bucket queue
+    uint32_t m_rankGranularity;              //!< Bytes per unit weight or ranks of a bucket
+    uint32_t m_batchBand;                    //!< Band selected by EnqueueBatch
+    std::vector<uint8_t> m_batchBands;       //!< Bands of the packets of a batch
+    std::vector<uint32_t> m_batchOrder;      //!< Packets of a batch sorted by band
+
+    /// Traced callback for the enqueue of a packet in a band
+    TracedCallback<Ptr<const QueueDiscItem>, uint32_t> m_traceBandEnqueue;
+    /// Traced callback for the dequeue of a packet from a band
+    TracedCallback<Ptr<const QueueDiscItem>, uint32_t> m_traceBandDequeue;
 };
 
 /**
@@ -93,6 +594,28 @@ std::istream& operator>>(std::istream& is, WFQmap& priomap);
 
 ATTRIBUTE_HELPER_HEADER(WFQmap);
 
+/**
+ * Serialize the band weights to the given ostream
+ *
+ * \param os
+ * \param weights
+ *
+ * \return std::ostream
+ */
+std::ostream& operator<<(std::ostream& os, const WFQweights& weights);
+
+/**
+ * Serialize from the given istream to the band weights.
+ *
+ * \param is
+ * \param weights
+ *
+ * \return std::istream
+ */
+std::istream& operator>>(std::istream& is, WFQweights& weights);
+
+ATTRIBUTE_HELPER_HEADER(WFQweights);
+
 } // namespace ns3
 
 #endif /* WFQ_QUEUE_DISC_H */
@@ -0,0 +1,165 @@
+/*
+ * Stress test of the virtual clock of WFQQueueDisc.
+ *
+ * The bands of a WFQQueueDisc are kept backlogged with packets of random
+ * sizes and served for a large number of packets, which makes the fixed-point
+ * virtual times wrap around many times. After each dequeue, the fairness error,
+ * i.e., the largest difference between the bytes served to two bands divided
+ * by their weights, is checked against the bound of the virtual time
+ * schedulers: Lmax / w_i + Lmax / w_j (plus the virtual time covered by a
+ * bucket in BucketedWFQ mode).
+ *
+ * Usage: ./ns3 run "wfq-fairness-stress --packets=1000000000 --scheduler=WF2Q+"
+ */
+
+#include "ns3/core-module.h"
+#include "ns3/network-module.h"
+#include "ns3/traffic-control-module.h"
+#include "ns3/wfq-queue-disc.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+using namespace ns3;
+
+/**
+ * Queue disc item carrying a bare packet.
+ */
+class StressItem : public QueueDiscItem
+{
+  public:
+    /**
+     * Constructor
+     *
+     * \param p the packet
+     */
+    StressItem(Ptr<Packet> p)
+        : QueueDiscItem(p, Address(), 0)
+    {
+    }
+
+    void AddHeader() override
+    {
+    }
+
+    bool Mark() override
+    {
+        return false;
+    }
+};
+
+/**
+ * Create a packet of random size for a band.
+ *
+ * \param band the band, which is also the priority of the packet
+ * \param size the random variable giving the size of the packet
+ * \param maxSize the largest packet size
+ * \return the packet
+ */
+static Ptr<QueueDiscItem>
+CreateItem(uint8_t band, Ptr<UniformRandomVariable> size, uint32_t maxSize)
+{
+    Ptr<Packet> p = Create<Packet>(size->GetInteger(64, maxSize));
+    SocketPriorityTag priorityTag;
+    priorityTag.SetPriority(band);
+    p->AddPacketTag(priorityTag);
+    return Create<StressItem>(p);
+}
+
+int
+main(int argc, char* argv[])
+{
+    uint64_t packets = 1000000000;
+    std::string scheduler = "WF2Q+";
+    uint32_t maxSize = 1500;
+    uint32_t depth = 16;
+
+    CommandLine cmd(__FILE__);
+    cmd.AddValue("packets", "Number of packets to dequeue", packets);
+    cmd.AddValue("scheduler", "WFQ, WF2Q+ or BucketedWFQ", scheduler);
+    cmd.AddValue("maxSize", "Largest packet size in bytes", maxSize);
+    cmd.AddValue("depth", "Number of packets kept in each band", depth);
+    cmd.Parse(argc, argv);
+
+    const std::vector<uint32_t> weights{1, 2, 5};
+
+    Ptr<WFQQueueDisc> qdisc = CreateObject<WFQQueueDisc>();
+    qdisc->SetAttribute("Scheduler", StringValue(scheduler));
+    for (uint8_t band = 0; band < weights.size(); band++)
+    {
+        qdisc->SetBandForWFQrity(band, band);
+        qdisc->SetBandWeight(band, weights[band]);
+    }
+    qdisc->Initialize();
+
+    Ptr<UniformRandomVariable> size = CreateObject<UniformRandomVariable>();
+
+    for (uint8_t band = 0; band < weights.size(); band++)
+    {
+        for (uint32_t i = 0; i < depth; i++)
+        {
+            qdisc->Enqueue(CreateItem(band, size, maxSize));
+        }
+    }
+
+    double bound = 0;
+    for (uint32_t i = 0; i < weights.size(); i++)
+    {
+        for (uint32_t j = i + 1; j < weights.size(); j++)
+        {
+            bound = std::max(bound, double(maxSize) / weights[i] + double(maxSize) / weights[j]);
+        }
+    }
+    if (scheduler == "BucketedWFQ")
+    {
+        UintegerValue granularity;
+        qdisc->GetAttribute("RankGranularity", granularity);
+        bound += granularity.Get();
+    }
+
+    std::vector<uint64_t> served(weights.size(), 0);
+    double maxError = 0;
+
+    for (uint64_t n = 0; n < packets; n++)
+    {
+        Ptr<QueueDiscItem> item = qdisc->Dequeue();
+        NS_ABORT_MSG_IF(!item, "The queue disc stopped serving backlogged bands");
+
+        SocketPriorityTag priorityTag;
+        item->GetPacket()->PeekPacketTag(priorityTag);
+        uint8_t band = priorityTag.GetPriority();
+        served[band] += item->GetSize();
+
+        // keep the band backlogged
+        qdisc->Enqueue(CreateItem(band, size, maxSize));
+
+        double lowest = INFINITY;
+        double highest = 0;
+        for (uint32_t i = 0; i < weights.size(); i++)
+        {
+            double normalized = double(served[i]) / weights[i];
+            lowest = std::min(lowest, normalized);
+            highest = std::max(highest, normalized);
+        }
+        maxError = std::max(maxError, highest - lowest);
+
+        if (maxError > bound)
+        {
+            std::cerr << "Fairness error " << maxError << " above the bound " << bound
+                      << " after " << n + 1 << " packets" << std::endl;
+            return 1;
+        }
+    }
+
+    // the virtual time advances by about the bytes served per unit weight and
+    // wraps around every 2^32 of them
+    double perWeight = double(served[0]) / weights[0];
+    std::cout << "Scheduler " << scheduler << ": " << packets << " packets, "
+              << std::floor(perWeight / 4294967296.0) << " virtual time wraparounds, "
+              << "max fairness error " << maxError << " (bound " << bound << ")" << std::endl;
+
+    Simulator::Destroy();
+    return 0;
+}